@@ -101,7 +101,7 @@ int apUp()
   return 0;
 }
 
-static void apDown()
+void apDown()
 {
   dhcpServerStop(&apIf);
   netifapi_netif_set_down(&apIf);
@@ -109,6 +109,11 @@ static void apDown()
   apActive = false;
 }
 
+bool apIsActive()
+{
+  return apActive;
+}
+
 /*
  * Activate access point in EMW3165, handy for initial configuration.
  */
@@ -125,9 +130,8 @@ static int ap(EshContext* ctx)
 
     if (apActive) {
 
-      apDown();
-      eshPrintf(ctx, "AP stopped.\n");
-      apActive = false;
+      connApStop();
+      eshPrintf(ctx, "Stopping AP.\n");
     }
 
     return 0;
@@ -139,9 +143,7 @@ static int ap(EshContext* ctx)
     return -1;
   }
 
-  if (apUp() == -1)
-    eshPrintf(ctx, "Cannot start AP.\n");
-
+  connApStart();
   return 0;
 }
 
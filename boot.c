@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Boot orchestrator. Each boot stage runs in its own task
+ * as soon as stages it depends on are done, so independent
+ * stages (like display reset and wifi firmware load)
+ * overlap. Start and end time of each stage is printed.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emw-meter.h"
+
+static JIF_t bootStarted;
+static POSSEMA_t bootDone;
+
+static void stageTask(void* arg)
+{
+  BootStage* stage = (BootStage*)arg;
+  BootStage* dep;
+  int i;
+
+  for (i = 0; i < BOOT_MAX_DEPS && stage->deps[i] != NULL; i++) {
+
+    dep = stage->deps[i];
+
+/*
+ * Put token back, so that other stages waiting for
+ * same dependency see it too.
+ */
+    posSemaGet(dep->done);
+    posSemaSignal(dep->done);
+  }
+
+  stage->started = jiffies;
+  stage->run();
+  stage->finished = jiffies;
+
+  printf("boot: %-8s %5lu - %5lu ms\n",
+         stage->name,
+         (unsigned long)((stage->started - bootStarted) * 1000 / HZ),
+         (unsigned long)((stage->finished - bootStarted) * 1000 / HZ));
+
+  posSemaSignal(stage->done);
+  posSemaSignal(bootDone);
+}
+
+/*
+ * Run boot stages and wait until all of them are done.
+ */
+void bootRun(BootStage* stages, int count)
+{
+  int i;
+  BootStage* stage;
+
+  bootStarted = jiffies;
+  bootDone = posSemaCreate(0);
+
+  for (i = 0, stage = stages; i < count; i++, stage++)
+    stage->done = posSemaCreate(0);
+
+  for (i = 0, stage = stages; i < count; i++, stage++)
+    nosTaskCreate(stageTask, stage, 2, stage->stack, stage->name);
+
+  for (i = 0; i < count; i++)
+    posSemaGet(bootDone);
+
+  printf("boot: done in %lu ms\n", (unsigned long)((jiffies - bootStarted) * 1000 / HZ));
+}
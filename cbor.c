@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compact binary (cbor, RFC 7049) payload support.
+ * Scanner works like json scanner: input is fed in pieces
+ * and numbers at interesting map key paths are stored
+ * into targets. Only text string map keys take part in
+ * paths. Indefinite length arrays and maps are supported,
+ * indefinite length strings are not.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "emw-meter.h"
+
+enum {
+  S_HEAD,
+  S_ARG,
+  S_KEY,
+  S_SKIP,
+  S_DONE
+};
+
+#define MT_UINT   0
+#define MT_NEGINT 1
+#define MT_BYTES  2
+#define MT_TEXT   3
+#define MT_ARRAY  4
+#define MT_MAP    5
+#define MT_TAG    6
+#define MT_SIMPLE 7
+
+#define AI_INDEFINITE 31
+#define CBOR_BREAK    0xff
+
+void cborScanInit(CborScan* scan, JsonScanTarget* targets, int count)
+{
+  int i;
+
+  memset(scan, '\0', sizeof(CborScan));
+  scan->targets = targets;
+  scan->targetCount = count;
+  scan->state = S_HEAD;
+
+  for (i = 0; i < count; i++) {
+
+    targets[i].pathLen = strlen(targets[i].path);
+    targets[i].value = MISSING_VALUE;
+    targets[i].found = false;
+    targets[i].invalid = false;
+  }
+}
+
+static JsonScanTarget* currentTarget(CborScan* scan)
+{
+  if (scan->pathTooLong)
+    return NULL;
+
+  return scanTargetFind(scan->targets, scan->targetCount, scan->path, scan->pathLen);
+}
+
+static void invalidValue(CborScan* scan)
+{
+  JsonScanTarget* t = currentTarget(scan);
+
+  if (t != NULL) {
+
+    t->value = MISSING_VALUE;
+    t->invalid = true;
+  }
+}
+
+static void numberValue(CborScan* scan, float v)
+{
+  JsonScanTarget* t = currentTarget(scan);
+
+  if (t == NULL || t->invalid)
+    return;
+
+  if (!isfinite(v)) {
+
+    t->value = MISSING_VALUE;
+    t->invalid = true;
+    return;
+  }
+
+  t->value = v;
+  t->found = true;
+}
+
+static float halfToFloat(uint16_t h)
+{
+  int exp = (h >> 10) & 0x1f;
+  int mant = h & 0x3ff;
+  float v;
+
+  if (exp == 0)
+    v = ldexpf(mant, -24);
+  else if (exp != 31)
+    v = ldexpf(mant + 1024, exp - 25);
+  else
+    v = mant == 0 ? INFINITY : NAN;
+
+  return (h & 0x8000) ? -v : v;
+}
+
+static inline bool inKey(CborScan* scan)
+{
+  return scan->depth > 0 &&
+         scan->stack[scan->depth - 1].isMap &&
+         scan->stack[scan->depth - 1].key;
+}
+
+static void pop(CborScan* scan);
+
+/*
+ * An item (scalar or complete container) has been
+ * processed. Advance parent container state.
+ */
+static void itemDone(CborScan* scan)
+{
+  CborLevel* top;
+
+  scan->state = S_HEAD;
+  if (scan->depth == 0) {
+
+    scan->state = S_DONE;
+    return;
+  }
+
+  top = &scan->stack[scan->depth - 1];
+  if (top->isMap && top->key) {
+
+    top->key = false;
+    return;
+  }
+
+  if (top->isMap)
+    top->key = true;
+  else
+    scan->pathLen = top->basePathLen;
+
+  if (top->remaining > 0 && --top->remaining == 0)
+    pop(scan);
+}
+
+static void pop(CborScan* scan)
+{
+  scan->depth--;
+  scan->pathLen = scan->stack[scan->depth].basePathLen;
+  scan->pathTooLong = false;
+  itemDone(scan);
+}
+
+static bool push(CborScan* scan, bool isMap, int32_t remaining)
+{
+  CborLevel* level;
+
+  if (scan->depth >= JSON_SCAN_MAX_DEPTH)
+    return false;
+
+  level = &scan->stack[scan->depth++];
+  level->isMap = isMap;
+  level->key = isMap;
+  level->basePathLen = scan->pathLen;
+  level->remaining = remaining;
+
+  if (remaining == 0)
+    pop(scan);
+
+  return true;
+}
+
+static void keyStart(CborScan* scan)
+{
+  scan->pathLen = scan->stack[scan->depth - 1].basePathLen;
+  scan->pathTooLong = scan->pathLen >= JSON_SCAN_MAX_PATH;
+  if (scan->pathLen > 0 && !scan->pathTooLong)
+    scan->path[scan->pathLen++] = '.';
+}
+
+static void keyChar(CborScan* scan, char c)
+{
+  if (scan->pathLen >= JSON_SCAN_MAX_PATH) {
+
+    scan->pathTooLong = true;
+    return;
+  }
+
+  scan->path[scan->pathLen++] = c;
+}
+
+/*
+ * Only text keys are part of paths. Make sure that
+ * nothing below other keys matches any target.
+ */
+static void nonTextKey(CborScan* scan)
+{
+  scan->pathLen = JSON_SCAN_MAX_PATH;
+  scan->pathTooLong = true;
+}
+
+/*
+ * Skip string contents. Strings are never interesting
+ * as values, as map keys only text strings are.
+ */
+static void skipString(CborScan* scan, bool key, bool text)
+{
+  if (key) {
+
+    if (text)
+      keyStart(scan);
+    else
+      nonTextKey(scan);
+  }
+  else
+    invalidValue(scan);
+
+  scan->skip = scan->arg;
+  if (scan->skip == 0)
+    itemDone(scan);
+  else
+    scan->state = (key && text) ? S_KEY : S_SKIP;
+}
+
+static bool headComplete(CborScan* scan)
+{
+  int major = scan->head >> 5;
+  int ai = scan->head & 0x1f;
+  bool key = inKey(scan);
+  union {
+    uint32_t u;
+    float    f;
+  } f32;
+  union {
+    uint64_t u;
+    double   d;
+  } f64;
+
+  if (key && major != MT_TEXT && major != MT_BYTES &&
+      major != MT_UINT && major != MT_NEGINT && major != MT_TAG)
+    return false;
+
+  switch (major) {
+  case MT_UINT:
+  case MT_NEGINT:
+    if (key)
+      nonTextKey(scan);
+    else if (major == MT_UINT)
+      numberValue(scan, (float)scan->arg);
+    else
+      numberValue(scan, -1.0f - (float)scan->arg);
+
+    itemDone(scan);
+    return true;
+
+  case MT_BYTES:
+  case MT_TEXT:
+    if (ai == AI_INDEFINITE)
+      return false;
+
+    skipString(scan, key, major == MT_TEXT);
+    return true;
+
+  case MT_ARRAY:
+    scan->state = S_HEAD;
+    return push(scan, false, ai == AI_INDEFINITE ? -1 : (int32_t)scan->arg);
+
+  case MT_MAP:
+    invalidValue(scan);
+    scan->state = S_HEAD;
+    return push(scan, true, ai == AI_INDEFINITE ? -1 : (int32_t)scan->arg);
+
+  case MT_TAG:
+    scan->state = S_HEAD;
+    return true;
+
+  case MT_SIMPLE:
+    switch (ai) {
+    case 25:
+      numberValue(scan, halfToFloat(scan->arg));
+      break;
+
+    case 26:
+      f32.u = scan->arg;
+      numberValue(scan, f32.f);
+      break;
+
+    case 27:
+      f64.u = scan->arg;
+      numberValue(scan, f64.d);
+      break;
+
+    default:
+      invalidValue(scan);
+      break;
+    }
+
+    itemDone(scan);
+    return true;
+  }
+
+  return false;
+}
+
+static bool step(CborScan* scan, uint8_t b)
+{
+  int ai;
+  CborLevel* top;
+
+  switch (scan->state) {
+  case S_HEAD:
+    if (b == CBOR_BREAK) {
+
+      if (scan->depth == 0)
+        return false;
+
+      top = &scan->stack[scan->depth - 1];
+      if (top->remaining != -1 || (top->isMap && !top->key))
+        return false;
+
+      pop(scan);
+      return true;
+    }
+
+    scan->head = b;
+    scan->arg = 0;
+    ai = b & 0x1f;
+    if (ai < 24) {
+
+      scan->arg = ai;
+      return headComplete(scan);
+    }
+
+    if (ai <= 27) {
+
+      scan->argBytes = 1 << (ai - 24);
+      scan->state = S_ARG;
+      return true;
+    }
+
+    if (ai == AI_INDEFINITE)
+      return headComplete(scan);
+
+    return false;
+
+  case S_ARG:
+    scan->arg = (scan->arg << 8) | b;
+    if (--scan->argBytes == 0)
+      return headComplete(scan);
+
+    return true;
+
+  case S_KEY:
+    keyChar(scan, (char)b);
+
+  /* fall through */
+  case S_SKIP:
+    if (--scan->skip == 0)
+      itemDone(scan);
+
+    return true;
+
+  case S_DONE:
+    return false;
+  }
+
+  return false;
+}
+
+int cborScanFeed(CborScan* scan, const uint8_t* data, int len)
+{
+  if (scan->error)
+    return -1;
+
+  while (len-- > 0) {
+
+    if (!step(scan, *data++)) {
+
+      scan->error = true;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int cborScanEnd(CborScan* scan)
+{
+  if (scan->error || scan->state != S_DONE) {
+
+    scan->error = true;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Encoder.
+ */
+void cborEncInit(CborEnc* enc, uint8_t* buf, int max)
+{
+  enc->buf = buf;
+  enc->max = max;
+  enc->len = 0;
+  enc->overflow = false;
+}
+
+static void put(CborEnc* enc, const uint8_t* data, int len)
+{
+  if (enc->len + len > enc->max) {
+
+    enc->overflow = true;
+    return;
+  }
+
+  memcpy(enc->buf + enc->len, data, len);
+  enc->len += len;
+}
+
+static void putHead(CborEnc* enc, int major, uint32_t arg)
+{
+  uint8_t h[5];
+  int len;
+
+  major <<= 5;
+  if (arg < 24) {
+
+    h[0] = major | arg;
+    len = 1;
+  }
+  else if (arg <= 0xff) {
+
+    h[0] = major | 24;
+    h[1] = arg;
+    len = 2;
+  }
+  else if (arg <= 0xffff) {
+
+    h[0] = major | 25;
+    h[1] = arg >> 8;
+    h[2] = arg;
+    len = 3;
+  }
+  else {
+
+    h[0] = major | 26;
+    h[1] = arg >> 24;
+    h[2] = arg >> 16;
+    h[3] = arg >> 8;
+    h[4] = arg;
+    len = 5;
+  }
+
+  put(enc, h, len);
+}
+
+void cborEncMap(CborEnc* enc, int pairs)
+{
+  putHead(enc, MT_MAP, pairs);
+}
+
+void cborEncArray(CborEnc* enc, int items)
+{
+  putHead(enc, MT_ARRAY, items);
+}
+
+void cborEncText(CborEnc* enc, const char* str)
+{
+  int len = strlen(str);
+
+  putHead(enc, MT_TEXT, len);
+  put(enc, (const uint8_t*)str, len);
+}
+
+void cborEncInt(CborEnc* enc, int value)
+{
+  if (value < 0)
+    putHead(enc, MT_NEGINT, -1 - value);
+  else
+    putHead(enc, MT_UINT, value);
+}
+
+void cborEncFloat(CborEnc* enc, float value)
+{
+  union {
+    uint32_t u;
+    float    f;
+  } f32;
+  uint8_t b[5];
+
+  f32.f = value;
+  b[0] = (MT_SIMPLE << 5) | 26;
+  b[1] = f32.u >> 24;
+  b[2] = f32.u >> 16;
+  b[3] = f32.u >> 8;
+  b[4] = f32.u;
+  put(enc, b, 5);
+}
+
+/*
+ * Return encoded length or -1 if buffer was too small.
+ */
+int cborEncEnd(CborEnc* enc)
+{
+  return enc->overflow ? -1 : enc->len;
+}
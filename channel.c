@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Channel store. Each channel holds current value of
+ * a measurement and history of it for graphs. Producers
+ * (mqtt, sensors) update channels, gui only reads them.
+ * Nothing here depends on network or hardware.
+ */
+
+#include <picoos.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "emw-meter.h"
+
+Channel insideChannel  = { .name = "inside",  .scale = 10 };
+Channel outsideChannel = { .name = "outside", .scale = 10 };
+Channel powerChannel   = { .name = "power",   .scale = 1 };
+
+#define MAX_CHANNELS 8
+
+static POSMUTEX_t channelMutex;
+static Channel* channels[MAX_CHANNELS];
+static int channelCount;
+
+void channelInit()
+{
+  channelMutex = posMutexCreate();
+  channelRegister(&insideChannel);
+  channelRegister(&outsideChannel);
+  channelRegister(&powerChannel);
+}
+
+/*
+ * Add channel to list of known channels, so that it
+ * can be found by name. Registering same channel again
+ * does nothing.
+ */
+bool channelRegister(Channel* ch)
+{
+  int i;
+  bool ok = true;
+
+  channelLock();
+  for (i = 0; i < channelCount; i++)
+    if (channels[i] == ch)
+      break;
+
+  if (i == channelCount) {
+
+    if (channelCount < MAX_CHANNELS) {
+
+      channelClear(ch);
+      channels[channelCount++] = ch;
+    }
+    else
+      ok = false;
+  }
+
+  channelUnlock();
+  return ok;
+}
+
+Channel* channelFind(const char* name)
+{
+  int i;
+  Channel* ch = NULL;
+
+  channelLock();
+  for (i = 0; i < channelCount; i++)
+    if (!strcmp(channels[i]->name, name)) {
+
+      ch = channels[i];
+      break;
+    }
+
+  channelUnlock();
+  return ch;
+}
+
+void channelLock()
+{
+  posMutexLock(channelMutex);
+}
+
+void channelUnlock()
+{
+  posMutexUnlock(channelMutex);
+}
+
+void channelClear(Channel* ch)
+{
+  int i;
+  int16_t* sp;
+
+  ch->value = MISSING_VALUE;
+  for (sp = ch->stats, i = 0; i < MAX_STATS; i++, sp++)
+    *sp = MISSING_VALUE;
+}
+
+void channelSet(Channel* ch, float value)
+{
+  channelLock();
+  ch->value = value;
+  ++ch->updates;
+  channelUnlock();
+}
+
+float channelGet(Channel* ch)
+{
+  float value;
+
+  channelLock();
+  value = ch->value;
+  channelUnlock();
+  return value;
+}
+
+/*
+ * Get value and update counter, so that caller can
+ * detect if value has been updated since last time.
+ */
+float channelRead(Channel* ch, uint32_t* updates)
+{
+  float value;
+
+  channelLock();
+  value = ch->value;
+  *updates = ch->updates;
+  channelUnlock();
+  return value;
+}
+
+/*
+ * Add current value of channel to history.
+ */
+void channelSample(Channel* ch)
+{
+  channelLock();
+  memmove(ch->stats, ch->stats + 1, (MAX_STATS - 1) * sizeof(ch->stats[0]));
+  if (IS_MISSING(ch->value))
+    ch->stats[MAX_STATS - 1] = MISSING_VALUE;
+  else
+    ch->stats[MAX_STATS - 1] = round(ch->value * ch->scale);
+
+  channelUnlock();
+}
+
+/*
+ * Copy history of channel, so that caller can
+ * use it without holding the lock.
+ */
+void channelHistory(Channel* ch, int16_t* stats)
+{
+  channelLock();
+  memcpy(stats, ch->stats, sizeof(ch->stats));
+  channelUnlock();
+}
@@ -324,7 +324,7 @@ extern void *__heap_end;
  * If this definition is set to 1, the key string functions are
  * added to the user API.
  */
-#define NOSCFG_FEATURE_REGISTRY    0
+#define NOSCFG_FEATURE_REGISTRY    1
 
 /** Enable the query for key strings.
  * If this definition is set to 1, the functions ::nos_keyQueryBegin,
@@ -345,7 +345,7 @@ extern void *__heap_end;
  * This define sets the maximum length (characters) a key string can have.
  * If key strings are enabled, this define must be set to at least 4.
  */
-#define NOS_MAX_REGKEYLEN               8
+#define NOS_MAX_REGKEYLEN               12
 
 /** Key string housekeeping.
  * When ever a new key is created, the nano layer needs to call malloc().
@@ -28,6 +28,17 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Set to 1 to use USART6 in half-duplex mode instead of
+ * GPIO bit-banging (see owuart.c). Bus is then on PA11 (D14),
+ * which is otherwise unused SPI4 MISO. Set it with OWCFG_USART
+ * in CMakeLists.txt or Makefile, which also leave GPIO link
+ * layer of picoos-ow out of build.
+ */
+#ifndef OWCFG_USART
+#define OWCFG_USART 0
+#endif
+
 /*
  * Onewire gpio settings.
  */
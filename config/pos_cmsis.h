@@ -34,6 +34,9 @@ void USART2_IRQHandler(void);
 void SDIO_irq(void);
 void DMA2_Stream3_irq(void);
 void RTC_WKUP_IRQHandler(void);
+void DMA2_Stream1_irq(void);
+void EXTI9_5_irq(void);
+void TIM5_irq(void);
 
 /*
  * These are interrupt handlers inside Wiced usart code.
@@ -482,7 +482,7 @@
  * If this definition is set to 1, the function ::posInstallIdleTaskHook
  * will be added to the user API.
  */
-#define POSCFG_FEATURE_IDLETASKHOOK  0
+#define POSCFG_FEATURE_IDLETASKHOOK  1
 
 /** Enable atomic variable support.
  * If this definition is set to 1, the functions needed for accessing
@@ -140,7 +140,7 @@ void fsInit(void)
   cfg.phys_addr        = 0;
   cfg.phys_erase_block = 65536;
   cfg.log_block_size   = 65536;
-  cfg.log_page_size    = 256;
+  cfg.log_page_size    = FLASH_PAGE_SIZE;
 
   uosMountSpiffs("/flash", &flashDev, &cfg);
 }
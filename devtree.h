@@ -43,6 +43,12 @@ typedef struct {
   SPI_TypeDef* spi;
 } BusConf;
 
+/*
+ * Spiffs logical page size. File writes that are
+ * multiples of this program whole pages.
+ */
+#define FLASH_PAGE_SIZE 256
+
 extern UosSpiBus spi1Bus;
 extern UosSpiBus spi4Bus;
 
@@ -59,7 +65,8 @@ void devTreeInit(void);
 void fsInit(void);
 
 void init1Wire(void);
-float read1Wire(void);
+void owUartInit(void);
+void sensorStart(void);
 
 #endif
 
@@ -32,16 +32,41 @@
 #include "lwip/netif.h"
 
 void initConfig(void);
-void checkAP(void);
+void connStart(void);
+void connPowerSave(void);
+void ifStatusCallback(struct netif *netif);
+void connApStart(void);
+void connApStop(void);
 int  apUp(void);
+void apDown(void);
+bool apIsActive(void);
 void wifiLedInit(void);
 void wifiLed(bool on);
-void potatoInit(void);
 void potatoStart(void);
-void potatoLock(void);
-void potatoUnlock(void);
+
+bool wifiCacheJoin(const char* ap, const char* pass);
+bool wifiCachePreload(struct netif* netif, const char* ap);
+void wifiCacheUpdate(struct netif* netif, const char* ap);
+void wifiCacheClear(void);
+
+#define PS_OFF  0
+#define PS_POLL 1
+#define PS_FAST 2
+
+void  wifiPowerSave(void);
+JIF_t wifiReceiveTimeout(void);
+void  wifiLatency(JIF_t latency);
+
+uint32_t crc32(uint32_t crc, const void* buf, int len);
+int fwExpand(bool force);
+int fileCopy(const char* from, const char* to, uint32_t* crc);
+int fileCrc(const char* name, uint8_t* buf, int size, uint32_t* crc);
+
 void guiInit(void);
 void guiReset(void);
+void guiResetStart(void);
+bool guiResetting(void);
+bool guiHealthy(void);
 void guiStart(void);
 void guiUpdateScreen(void);
 
@@ -49,11 +74,285 @@ void guiUpdateScreen(void);
 #define MISSING_VALUE -32768
 #define IS_MISSING(x) (x < -32767)
 
-extern int16_t outsideStats[];
-extern int16_t insideStats[];
-extern int16_t powerStats[];
+/*
+ * Channel store.
+ */
+typedef struct {
+
+  const char* name;
+  int     scale;
+  float   value;
+  uint32_t updates;
+  int16_t stats[MAX_STATS];
+} Channel;
+
+extern Channel insideChannel;
+extern Channel outsideChannel;
+extern Channel powerChannel;
+
+void  channelInit(void);
+bool  channelRegister(Channel* ch);
+Channel* channelFind(const char* name);
+void  channelLock(void);
+void  channelUnlock(void);
+void  channelClear(Channel* ch);
+void  channelSet(Channel* ch, float value);
+float channelGet(Channel* ch);
+float channelRead(Channel* ch, uint32_t* updates);
+void  channelSample(Channel* ch);
+void  channelHistory(Channel* ch, int16_t* stats);
 
-extern double outsideTemperature;
-extern double insideTemperature;
-extern int power;
 extern char weatherSymbol;
+
+/*
+ * Periodic job scheduler.
+ */
+typedef struct schedJob {
+
+  const char* name;
+  void     (*run)(struct schedJob* job);
+  JIF_t    period;
+  JIF_t    tolerance;
+  JIF_t    due;
+  bool     active;
+  bool     linked;
+  uint32_t runs;
+  uint32_t coalesced;
+  struct schedJob* next;
+} SchedJob;
+
+void schedInit(void);
+void schedStart(void);
+void schedAdd(SchedJob* job, JIF_t delay);
+void schedStop(SchedJob* job);
+
+void pulseStart(void);
+bool pulseActive(void);
+
+/*
+ * 1-Wire slots over uart, see owslot.c.
+ */
+bool owUartTransfer(uint8_t* buf, int len, bool reset);
+
+void cycleInit(void);
+
+/*
+ * Fixed size block pools and per-message arenas.
+ * Buffer pool block is 10 flash pages, largest user is
+ * firmware expansion state (2 KB window + in/out buffers).
+ * Two blocks are needed for ota double buffering.
+ */
+#define BUFFER_POOL_SIZE   2560
+#define BUFFER_POOL_COUNT  2
+#define MESSAGE_ARENA_SIZE 512
+
+typedef struct {
+
+  const char* name;
+  int       blockSize;
+  int       blockCount;
+  uint8_t*  storage;
+  void*     freeList;
+  int       used;
+  int       highWater;
+  uint32_t  failures;
+} Pool;
+
+typedef struct {
+
+  const char* name;
+  uint8_t*  buf;
+  int       size;
+  int       used;
+  int       highWater;
+  uint32_t  failures;
+} Arena;
+
+extern Pool  bufferPool;
+extern Arena messageArena;
+
+void  memInit(void);
+void* poolAlloc(Pool* p);
+void  poolFree(Pool* p, void* block);
+void* arenaAlloc(Arena* a, int size);
+void  arenaReset(Arena* a);
+
+/*
+ * Sleep accounting, times are in microseconds.
+ */
+enum {
+  WAKE_RTC,
+  WAKE_WIFI,
+  WAKE_UART,
+  WAKE_TIMER,
+  WAKE_PULSE,
+  WAKE_OTHER,
+  WAKE_SOURCES
+};
+
+typedef struct {
+
+  uint64_t run;
+  uint64_t sleep;
+  uint64_t deep;
+  uint64_t slept[WAKE_SOURCES];
+  uint32_t wakeups[WAKE_SOURCES];
+} SleepStats;
+
+extern Channel sleepChannel;
+
+void sleepInit(void);
+void sleepStats(SleepStats* st);
+
+/*
+ * Trace points. Without TRACE they compile to nothing.
+ */
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+enum {
+  TRACE_RENDER,
+  TRACE_FLUSH,
+  TRACE_PARSE,
+  TRACE_ONEWIRE,
+  TRACE_IDS
+};
+
+#if TRACE
+void traceEvent(int id, bool begin);
+#define TRACE_BEGIN(id) traceEvent(id, true)
+#define TRACE_END(id)   traceEvent(id, false)
+#else
+#define TRACE_BEGIN(id) do { } while (0)
+#define TRACE_END(id)   do { } while (0)
+#endif
+
+/*
+ * Boot stages.
+ */
+#define BOOT_MAX_DEPS 3
+
+typedef struct bootStage {
+
+  const char* name;
+  void      (*run)(void);
+  struct bootStage* deps[BOOT_MAX_DEPS];
+  int       stack;
+  POSSEMA_t done;
+  JIF_t     started;
+  JIF_t     finished;
+} BootStage;
+
+void bootRun(BootStage* stages, int count);
+
+/*
+ * Publish policy.
+ */
+typedef struct {
+
+  const char* name;
+  float    absBand;
+  float    relBand;
+  float    minInterval;
+  float    maxInterval;
+  bool     published;
+  bool     pending;
+  float    lastValue;
+  JIF_t    lastTime;
+  uint32_t sent;
+  uint32_t suppressed;
+} PubPolicy;
+
+void pubPolicyLoad(PubPolicy* p);
+bool pubPolicyCheck(PubPolicy* p, float value, bool fresh);
+void pubPolicySent(PubPolicy* p, float value);
+
+/*
+ * Streaming json scanner.
+ */
+#define JSON_SCAN_MAX_DEPTH 8
+#define JSON_SCAN_MAX_PATH  48
+#define JSON_SCAN_MAX_TOKEN 24
+
+typedef struct {
+
+  const char* path;
+  int   pathLen;
+  float value;
+  bool  found;
+  bool  invalid;
+} JsonScanTarget;
+
+typedef struct {
+
+  JsonScanTarget* targets;
+  int     targetCount;
+  int     state;
+  int     depth;
+  uint8_t containers[JSON_SCAN_MAX_DEPTH];
+  uint8_t basePathLen[JSON_SCAN_MAX_DEPTH];
+  char    path[JSON_SCAN_MAX_PATH];
+  int     pathLen;
+  bool    pathTooLong;
+  char    token[JSON_SCAN_MAX_TOKEN];
+  int     tokenLen;
+  bool    tokenOverflow;
+  bool    error;
+} JsonScan;
+
+void jsonScanInit(JsonScan* scan, JsonScanTarget* targets, int count);
+int  jsonScanFeed(JsonScan* scan, const uint8_t* data, int len);
+int  jsonScanEnd(JsonScan* scan);
+JsonScanTarget* scanTargetFind(JsonScanTarget* targets, int count, const char* path, int len);
+
+/*
+ * Streaming cbor scanner, uses same targets as json scanner.
+ */
+typedef struct {
+
+  uint8_t isMap;
+  uint8_t key;
+  uint8_t basePathLen;
+  int32_t remaining;
+} CborLevel;
+
+typedef struct {
+
+  JsonScanTarget* targets;
+  int       targetCount;
+  int       state;
+  uint8_t   head;
+  int       argBytes;
+  uint64_t  arg;
+  uint32_t  skip;
+  int       depth;
+  CborLevel stack[JSON_SCAN_MAX_DEPTH];
+  char      path[JSON_SCAN_MAX_PATH];
+  int       pathLen;
+  bool      pathTooLong;
+  bool      error;
+} CborScan;
+
+void cborScanInit(CborScan* scan, JsonScanTarget* targets, int count);
+int  cborScanFeed(CborScan* scan, const uint8_t* data, int len);
+int  cborScanEnd(CborScan* scan);
+
+/*
+ * Cbor encoder, writes into caller supplied buffer.
+ */
+typedef struct {
+
+  uint8_t* buf;
+  int      max;
+  int      len;
+  bool     overflow;
+} CborEnc;
+
+void cborEncInit(CborEnc* enc, uint8_t* buf, int max);
+void cborEncMap(CborEnc* enc, int pairs);
+void cborEncArray(CborEnc* enc, int items);
+void cborEncText(CborEnc* enc, const char* str);
+void cborEncInt(CborEnc* enc, int value);
+void cborEncFloat(CborEnc* enc, float value);
+int  cborEncEnd(CborEnc* enc);
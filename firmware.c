@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Wifi firmware is stored LZSS compressed in romfs
+ * (see tools/lzpack.c). During boot it is expanded
+ * to spiffs, where wiced driver finds it. Expansion is
+ * done only if firmware has changed since last time,
+ * this is detected by comparing crc in compressed file
+ * to one saved after last successful expansion.
+ * Both expansion and plain copy write whole flash pages
+ * and verify result by reading it back.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+
+#include "lwip/sys.h"
+#include "emw-meter.h"
+#include "devtree.h"
+
+#define COPY_BUF BUFFER_POOL_SIZE
+
+#if BUNDLE_FIRMWARE
+
+#define FW_PACKED "/firmware/" WDCFG_FIRMWARE ".lz"
+#define FW_FLASH  "/flash/" WDCFG_FIRMWARE
+#define FW_STAMP  "/flash/" WDCFG_FIRMWARE ".crc"
+
+#define LZ_WINDOW    2048
+#define LZ_MIN_MATCH 3
+
+/*
+ * Decoder state, allocated from buffer pool.
+ */
+typedef struct {
+
+  int      from;
+  int      to;
+  int      inPos;
+  int      inLen;
+  int      outLen;
+  uint32_t pos;
+  uint32_t total;
+  uint32_t crc;
+  uint8_t  window[LZ_WINDOW];
+  uint8_t  in[128];
+  uint8_t  out[FLASH_PAGE_SIZE];
+} LzState;
+
+_Static_assert(sizeof(LzState) <= BUFFER_POOL_SIZE, "LzState does not fit to buffer pool block");
+
+#endif
+
+uint32_t crc32(uint32_t crc, const void* buf, int len)
+{
+  const uint8_t* p = buf;
+  int k;
+
+  crc = ~crc;
+  while (len--) {
+
+    crc ^= *p++;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+  }
+
+  return ~crc;
+}
+
+/*
+ * Read full buffer, romfs and spiffs may return
+ * less than requested.
+ */
+static int readFull(int fd, uint8_t* buf, int size)
+{
+  int len = 0;
+  int n;
+
+  while (len < size) {
+
+    n = read(fd, buf + len, size - len);
+    if (n < 0)
+      return -1;
+
+    if (n == 0)
+      break;
+
+    len += n;
+  }
+
+  return len;
+}
+
+/*
+ * Calculate crc of file contents.
+ */
+int fileCrc(const char* name, uint8_t* buf, int size, uint32_t* crc)
+{
+  int fd;
+  int len;
+
+  fd = open(name, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  *crc = 0;
+  while ((len = readFull(fd, buf, size)) > 0)
+    *crc = crc32(*crc, buf, len);
+
+  close(fd);
+  return len;
+}
+
+/*
+ * Copy file to spiffs. Old file is removed first so that
+ * its pages can be reused, data is written in multiples of
+ * flash page size. Copy is read back and verified against
+ * crc of source. Returns number of bytes copied or -1.
+ */
+int fileCopy(const char* from, const char* to, uint32_t* crc)
+{
+  uint8_t* buf;
+  uint32_t written;
+  int src, dst;
+  int len;
+  int st = 0;
+
+  buf = poolAlloc(&bufferPool);
+  if (buf == NULL)
+    return -1;
+
+  src = open(from, O_RDONLY);
+  if (src == -1) {
+
+    poolFree(&bufferPool, buf);
+    return -1;
+  }
+
+  uosFileUnlink(to);
+  dst = open(to, O_WRONLY | O_CREAT | O_TRUNC);
+  if (dst == -1) {
+
+    close(src);
+    poolFree(&bufferPool, buf);
+    return -1;
+  }
+
+  *crc = 0;
+  written = 0;
+  while ((len = readFull(src, buf, COPY_BUF)) > 0) {
+
+    *crc = crc32(*crc, buf, len);
+    if (write(dst, buf, len) != len) {
+
+      st = -1;
+      break;
+    }
+
+    written += len;
+  }
+
+  if (len < 0)
+    st = -1;
+
+  close(src);
+  close(dst);
+
+  if (st == 0) {
+
+    uint32_t check;
+
+    if (fileCrc(to, buf, COPY_BUF, &check) < 0 || check != *crc)
+      st = -1;
+  }
+
+  poolFree(&bufferPool, buf);
+  if (st == -1) {
+
+    uosFileUnlink(to);
+    return -1;
+  }
+
+  return written;
+}
+
+#if BUNDLE_FIRMWARE
+
+static uint32_t get32(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int getByte(LzState* lz)
+{
+  if (lz->inPos == lz->inLen) {
+
+    lz->inLen = read(lz->from, lz->in, sizeof(lz->in));
+    lz->inPos = 0;
+    if (lz->inLen <= 0)
+      return -1;
+  }
+
+  return lz->in[lz->inPos++];
+}
+
+static int flush(LzState* lz)
+{
+  if (lz->outLen == 0)
+    return 0;
+
+  lz->crc = crc32(lz->crc, lz->out, lz->outLen);
+  if (write(lz->to, lz->out, lz->outLen) != lz->outLen)
+    return -1;
+
+  lz->total += lz->outLen;
+  lz->outLen = 0;
+  return 0;
+}
+
+static int putByte(LzState* lz, uint8_t c)
+{
+  lz->window[lz->pos++ & (LZ_WINDOW - 1)] = c;
+  lz->out[lz->outLen++] = c;
+  if (lz->outLen == sizeof(lz->out))
+    return flush(lz);
+
+  return 0;
+}
+
+/*
+ * Decompress stream to output file. Only the
+ * window of last 2 KB of output is kept in memory.
+ */
+static int expand(LzState* lz, uint32_t len)
+{
+  int flags = 0;
+  int item = 8;
+  int b0, b1, n;
+  uint32_t dist;
+
+  while (lz->total + lz->outLen < len) {
+
+    if (item == 8) {
+
+      flags = getByte(lz);
+      if (flags < 0)
+        return -1;
+
+      item = 0;
+    }
+
+    if (flags & (1 << item)) {
+
+      b0 = getByte(lz);
+      if (b0 < 0 || putByte(lz, b0) < 0)
+        return -1;
+    }
+    else {
+
+      b0 = getByte(lz);
+      b1 = getByte(lz);
+      if (b0 < 0 || b1 < 0)
+        return -1;
+
+      dist = (b0 | ((b1 >> 5) << 8)) + 1;
+      n = (b1 & 0x1f) + LZ_MIN_MATCH;
+      if (dist > lz->pos || lz->total + lz->outLen + n > len)
+        return -1;
+
+      while (n--)
+        if (putByte(lz, lz->window[(lz->pos - dist) & (LZ_WINDOW - 1)]) < 0)
+          return -1;
+    }
+
+    ++item;
+  }
+
+  return flush(lz);
+}
+
+static bool stampValid(uint32_t crc)
+{
+  char buf[12];
+  int fd;
+  int len;
+
+  fd = open(FW_STAMP, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+
+  buf[len] = '\0';
+  if (strtoul(buf, NULL, 16) != crc)
+    return false;
+
+  fd = open(FW_FLASH, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  close(fd);
+  return true;
+}
+
+static void stampWrite(uint32_t crc)
+{
+  char buf[12];
+  int fd;
+  int len;
+
+  fd = open(FW_STAMP, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1)
+    return;
+
+  len = sprintf(buf, "%08lx", (unsigned long)crc);
+  write(fd, buf, len);
+  close(fd);
+}
+
+/*
+ * Expand compressed firmware to spiffs if it is
+ * missing or outdated. With force, expand always.
+ * Returns -1 on error, 0 if nothing was done and 1
+ * if firmware was expanded.
+ */
+int fwExpand(bool force)
+{
+  uint8_t hdr[12];
+  uint32_t len, crc;
+  LzState* lz;
+  JIF_t start;
+  int st;
+
+  int from = open(FW_PACKED, O_RDONLY);
+  if (from == -1)
+    return 0;
+
+  if (read(from, hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr, "LZS1", 4)) {
+
+    nosPrintf("%s: bad header.\n", FW_PACKED);
+    close(from);
+    return -1;
+  }
+
+  len = get32(hdr + 4);
+  crc = get32(hdr + 8);
+
+  if (!force && stampValid(crc)) {
+
+    close(from);
+    return 0;
+  }
+
+  lz = poolAlloc(&bufferPool);
+  if (lz == NULL) {
+
+    close(from);
+    return -1;
+  }
+
+  memset(lz, '\0', sizeof(LzState));
+  lz->from = from;
+
+  uosFileUnlink(FW_STAMP);
+  lz->to = open(FW_FLASH, O_WRONLY | O_CREAT | O_TRUNC);
+  if (lz->to == -1) {
+
+    nosPrintf("Cannot open %s.\n", FW_FLASH);
+    poolFree(&bufferPool, lz);
+    close(from);
+    return -1;
+  }
+
+  start = jiffies;
+  st = expand(lz, len);
+  close(lz->to);
+  close(from);
+
+  if (st == 0) {
+
+    uint32_t check;
+
+    if (lz->crc != crc || fileCrc(FW_FLASH, lz->window, sizeof(lz->window), &check) < 0 || check != crc) {
+
+      nosPrintf("%s: crc mismatch.\n", FW_FLASH);
+      st = -1;
+    }
+  }
+
+  if (st == 0) {
+
+    stampWrite(crc);
+    nosPrintf("Firmware expanded to %s, %lu bytes in %lu ms.\n",
+              FW_FLASH, (unsigned long)lz->total, (unsigned long)(jiffies - start) * 1000 / HZ);
+  }
+  else {
+
+    nosPrintf("Cannot expand %s.\n", FW_PACKED);
+    uosFileUnlink(FW_FLASH);
+  }
+
+  poolFree(&bufferPool, lz);
+  return st == 0 ? 1 : -1;
+}
+
+#endif
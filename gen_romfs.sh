@@ -54,6 +54,17 @@ else
 	FILE2C="xxd -i"
 fi
 
+#
+# Firmware images are compressed with tools/lzpack.c,
+# which is built here using host compiler.
+#
+LZPACK=${TMPDIR:-/tmp}/lzpack.$$
+trap "rm -f $LZPACK" EXIT
+if [ -n "$FILES" ]
+then
+	${HOSTCC:-cc} -O2 -o $LZPACK tools/lzpack.c || exit 1
+fi
+
 FILENO=0
 BYTES=0
 for F in $FILES
@@ -61,8 +72,10 @@ do
    FILENO=`expr $FILENO + 1`
    echo "// $F"
    case $F in
-   */seedfile|*.der|*.jpg|*.png|*.gif|*.bin)
+   */seedfile|*.der|*.jpg|*.png|*.gif)
       CAT=cat ;;
+   *.bin)
+      CAT="$LZPACK" ;;
    *)
       CAT="gzip -c" ;;
    esac
@@ -71,7 +84,7 @@ do
    echo $F $B >&2
    BYTES=`expr $BYTES + $B`
    echo "static const unsigned char file_$FILENO[] = {"
-   $CAT $F | $FILE2C
+   $CAT $F 2>/dev/null | $FILE2C
    echo "};"
 done
 
@@ -83,8 +96,10 @@ for F in $FILES
 do
    FILENO=`expr $FILENO + 1`
    case $F in
-   */seedfile|*.der|*.jpg|*.png|*.gif|*.bin)
+   */seedfile|*.der|*.jpg|*.png|*.gif)
       GZIP="" ;;
+   *.bin)
+      GZIP=".lz" ;;
    *)
       GZIP=".gz" ;;
    esac
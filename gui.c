@@ -32,6 +32,7 @@
 #include <picoos-u.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <eshell.h>
 #include "ugui.h"
 #include "devtree.h"
 #include "emw-meter.h"
@@ -44,191 +45,238 @@
 #define MAX_POS   0, 46
 #define MIN_POS   0, 55
 
-static void guiTask(void* arg)
+#define GUI_INTERVAL  5000
+#define GUI_TOLERANCE 1000
+
+static volatile bool resetRequested;
+static uint32_t displayResets;
+
+/*
+ * Display next measurement. Run by scheduler,
+ * so state is kept in static variables.
+ */
+static void guiJobRun(SchedJob* job)
 {
-  int meas = -1;
+  static int meas = -1;
+  static int16_t history[MAX_STATS];
   float t;
   char buf[20];
   int16_t* stats = NULL;
-  int displayResetCounter = 0;
-
-  while (true) {
-
-    ++meas;
-    if (meas > 2) {
 
-      meas = 0;
-
-      // Display sometimes gets corrupted,
-      // work around it by resetting it once per 10 minutes.
-      if (displayResetCounter >= 40) {
+/*
+ * Check again soon if display reset is still running.
+ */
+  if (guiResetting()) {
 
-        UG_FillScreen(C_BLACK);
-        guiUpdateScreen();
-        guiReset();
-        displayResetCounter = 0;
-      }
-    }
+    schedAdd(job, MS(100));
+    return;
+  }
 
-    ++displayResetCounter;
+  ++meas;
+  if (meas > 2)
+    meas = 0;
 
-    UG_FillScreen(C_BLACK);
+/*
+ * Display state is rewritten before each update, so full
+ * reset is needed only if requested or if control pins
+ * have been disturbed. Update is done when reset is over.
+ */
+  if (resetRequested || !guiHealthy()) {
 
-    UG_SetBackcolor(C_BLACK);
-    UG_SetForecolor(C_WHITE);
-    UG_FontSelect(&FONT_6X8);
+    resetRequested = false;
+    guiResetStart();
+    ++displayResets;
+    schedAdd(job, MS(100));
+    return;
+  }
 
-    switch (meas)
-    {
-    case 0:
-      t = read1Wire();
-      potatoLock();
-      insideTemperature = t;
-      stats = insideStats;
-      potatoUnlock();
-      if (IS_MISSING(t))
-        strcpy(buf, "--.-");
-      else
-        sprintf(buf, "%1.1f", t);
-
-      UG_PutString(LABEL_POS, "IN      C");
-      break;
-
-    case 1:
-      potatoLock();
-      t = outsideTemperature;
-      stats = outsideStats;
-      potatoUnlock();
-      if (IS_MISSING(t))
-        strcpy(buf, "--.-");
-      else
-        sprintf(buf, "%1.1f", t);
-      
-      UG_PutString(LABEL_POS, "OUT     C");
-      break;
-
-    case 2:
-      potatoLock();
-      t = power;
-      stats = powerStats;
-      potatoUnlock();
-      if (IS_MISSING(t))
-        strcpy(buf, "----");
-      else
-        sprintf(buf, "%1.0f", t);
-
-      UG_PutString(LABEL_POS, "PWR     W");
-      break;
-    }
+  TRACE_BEGIN(TRACE_RENDER);
+  UG_FillScreen(C_BLACK);
+
+  UG_SetBackcolor(C_BLACK);
+  UG_SetForecolor(C_WHITE);
+  UG_FontSelect(&FONT_6X8);
+
+  switch (meas)
+  {
+  case 0:
+    t = channelGet(&insideChannel);
+    channelHistory(&insideChannel, history);
+    stats = history;
+    if (IS_MISSING(t))
+      strcpy(buf, "--.-");
+    else
+      sprintf(buf, "%1.1f", t);
+
+    UG_PutString(LABEL_POS, "IN      C");
+    break;
+
+  case 1:
+    t = channelGet(&outsideChannel);
+    channelHistory(&outsideChannel, history);
+    stats = history;
+    if (IS_MISSING(t))
+      strcpy(buf, "--.-");
+    else
+      sprintf(buf, "%1.1f", t);
+    
+    UG_PutString(LABEL_POS, "OUT     C");
+    break;
+
+  case 2:
+    t = channelGet(&powerChannel);
+    channelHistory(&powerChannel, history);
+    stats = history;
+    if (IS_MISSING(t))
+      strcpy(buf, "----");
+    else
+      sprintf(buf, "%1.0f", t);
+
+    UG_PutString(LABEL_POS, "PWR     W");
+    break;
+  }
 
-    UG_FontSelect(&font_BebasNeue_17X34); //&FONT_22X36);
-    UG_PutString(VALUE_POS, buf);
+  UG_FontSelect(&font_BebasNeue_17X34); //&FONT_22X36);
+  UG_PutString(VALUE_POS, buf);
 
-    if (weatherSymbol && (meas == 0 || meas == 1)) {
+  if (weatherSymbol && (meas == 0 || meas == 1)) {
 
-      UG_FontSelect(&font_FMI_weather_34X33);
-      UG_PutChar(weatherSymbol, FORECAST_POS, C_WHITE, C_BLACK);
-    }
+    UG_FontSelect(&font_FMI_weather_34X33);
+    UG_PutChar(weatherSymbol, FORECAST_POS, C_WHITE, C_BLACK);
+  }
 
-    if (stats != NULL) {
+  if (stats != NULL) {
 
-      int x;
-      int v;
-      int min = 32767;
-      int max = -32768;
-      int i;
-      float scale;
-      int sum = 0;
-      int cnt = 0;
-      float avg;
+    int x;
+    int v;
+    int min = 32767;
+    int max = -32768;
+    int i;
+    float scale;
+    int sum = 0;
+    int cnt = 0;
+    float avg;
 
-      for (i = 0; i < MAX_STATS; i++) {
+    for (i = 0; i < MAX_STATS; i++) {
 
-        if (IS_MISSING(stats[i]))
-          continue;
+      if (IS_MISSING(stats[i]))
+        continue;
 
-        sum += stats[i];
-        cnt++;
-        
-        if (stats[i] > max)
-          max = stats[i];
+      sum += stats[i];
+      cnt++;
+      
+      if (stats[i] > max)
+        max = stats[i];
 
-        if (stats[i] < min)
-          min = stats[i];
-      }
+      if (stats[i] < min)
+        min = stats[i];
+    }
 
-      UG_FontSelect(&FONT_6X8);
+    UG_FontSelect(&FONT_6X8);
 
 
-      if (cnt) {
+    if (cnt) {
 
-        avg = ((float)sum) / cnt;
-        switch (meas) {
-        case 0:
-        case 1:
-          sprintf(buf, "MAX %5.1f", max * 0.1);
-          UG_PutString(MAX_POS, buf);
+      avg = ((float)sum) / cnt;
+      switch (meas) {
+      case 0:
+      case 1:
+        sprintf(buf, "MAX %5.1f", max * 0.1);
+        UG_PutString(MAX_POS, buf);
 
-          sprintf(buf, "MIN %5.1f", min * 0.1);
-          UG_PutString(MIN_POS, buf);
+        sprintf(buf, "MIN %5.1f", min * 0.1);
+        UG_PutString(MIN_POS, buf);
 
-          if (max - min < 50) {
+        if (max - min < 50) {
 
-            max = avg + 25;
-            min = avg - 25;
-          }
+          max = avg + 25;
+          min = avg - 25;
+        }
 
-          break;
+        break;
 
-        case 2:
-          sprintf(buf, "MAX %5d", max);
-          UG_PutString(MAX_POS, buf);
+      case 2:
+        sprintf(buf, "MAX %5d", max);
+        UG_PutString(MAX_POS, buf);
 
-          sprintf(buf, "MIN %5d", min);
-          UG_PutString(MIN_POS, buf);
+        sprintf(buf, "MIN %5d", min);
+        UG_PutString(MIN_POS, buf);
 
-          if (max < 2000)
-            max = 2000;
+        if (max < 2000)
+          max = 2000;
 
-          break;
-        }
+        break;
+      }
 
-        scale = 25.0 / (float) (max - min);
-        int prevX;
-        int prevV = MISSING_VALUE;
-        for (x = 68, i = 0; i < MAX_STATS; i++, x++) {
+      scale = 25.0 / (float) (max - min);
+      int prevX;
+      int prevV = MISSING_VALUE;
+      for (x = 68, i = 0; i < MAX_STATS; i++, x++) {
 
-          v = stats[i];
-          if (IS_MISSING(v))
-            continue;
+        v = stats[i];
+        if (IS_MISSING(v))
+          continue;
 
-          v = (v - min) * scale;
+        v = (v - min) * scale;
 
-          if (meas == 2) {
+        if (meas == 2) {
 
-            UG_DrawLine(x, 63, x, 63 - v, C_WHITE);
-          }
-          else {
+          UG_DrawLine(x, 63, x, 63 - v, C_WHITE);
+        }
+        else {
 
-             if (!IS_MISSING(prevV)) {
+           if (!IS_MISSING(prevV)) {
 
-               UG_DrawLine(prevX, 63 - prevV, x, 63 - v, C_WHITE);
-             }
+             UG_DrawLine(prevX, 63 - prevV, x, 63 - v, C_WHITE);
+           }
 
-             prevX = x;
-             prevV = v;
-          }
+           prevX = x;
+           prevV = v;
         }
       }
     }
-
-    guiUpdateScreen();
-    posTaskSleep(MS(5000));
   }
+
+  TRACE_END(TRACE_RENDER);
+  guiUpdateScreen();
 }
 
+static SchedJob guiJob = {
+  .name = "gui",
+  .run = guiJobRun,
+  .period = MS(GUI_INTERVAL),
+  .tolerance = MS(GUI_TOLERANCE)
+};
+
 void guiStart()
 {
-  nosTaskCreate(guiTask, NULL, 2, 3000, "GUI");
+  schedAdd(&guiJob, 0);
+}
+
+static int display(EshContext* ctx)
+{
+  char* reset = eshNamedArg(ctx, "reset", false);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (reset != NULL) {
+
+    resetRequested = true;
+    eshPrintf(ctx, "Display will be reset at next update.\n");
+    return 0;
+  }
+
+  eshPrintf(ctx, "%lu display resets.\n", (unsigned long)displayResets);
+  return 0;
 }
 
+const EshCommand displayCommand = {
+  .flags = 0,
+  .name = "display",
+  .help = "[--reset]\nshow display reset count or reset display",
+  .handler = display
+};
+
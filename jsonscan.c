@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Streaming json value extractor. Input can be fed in arbitrary
+ * sized pieces, only current key path and one number token
+ * are kept in memory. Numbers found at interesting key paths
+ * are stored into targets, for arrays the last element wins.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "emw-meter.h"
+
+enum {
+  S_VALUE,
+  S_VALUE_OR_END,
+  S_KEY_START,
+  S_KEY_OR_END,
+  S_KEY,
+  S_KEY_ESC,
+  S_COLON,
+  S_STRING,
+  S_STRING_ESC,
+  S_NUMBER,
+  S_LITERAL,
+  S_AFTER_VALUE,
+  S_DONE
+};
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+void jsonScanInit(JsonScan* scan, JsonScanTarget* targets, int count)
+{
+  int i;
+
+  memset(scan, '\0', sizeof(JsonScan));
+  scan->targets = targets;
+  scan->targetCount = count;
+  scan->state = S_VALUE;
+
+  for (i = 0; i < count; i++) {
+
+    targets[i].pathLen = strlen(targets[i].path);
+    targets[i].value = MISSING_VALUE;
+    targets[i].found = false;
+    targets[i].invalid = false;
+  }
+}
+
+/*
+ * Find target whose path matches given key path.
+ * Shared with cbor scanner.
+ */
+JsonScanTarget* scanTargetFind(JsonScanTarget* targets, int count, const char* path, int len)
+{
+  int i;
+  JsonScanTarget* t;
+
+  for (i = 0, t = targets; i < count; i++, t++) {
+
+    if (t->pathLen == len && !memcmp(t->path, path, len))
+      return t;
+  }
+
+  return NULL;
+}
+
+/*
+ * Return target which matches current key path, if any.
+ */
+static JsonScanTarget* currentTarget(JsonScan* scan)
+{
+  if (scan->pathTooLong)
+    return NULL;
+
+  return scanTargetFind(scan->targets, scan->targetCount, scan->path, scan->pathLen);
+}
+
+/*
+ * Non-numeric value at target path makes it invalid,
+ * just like array containing something else than numbers.
+ */
+static void invalidValue(JsonScan* scan)
+{
+  JsonScanTarget* t = currentTarget(scan);
+
+  if (t != NULL) {
+
+    t->value = MISSING_VALUE;
+    t->invalid = true;
+  }
+}
+
+static void numberValue(JsonScan* scan)
+{
+  JsonScanTarget* t = currentTarget(scan);
+  char* end;
+  float v;
+
+  if (t == NULL || t->invalid)
+    return;
+
+  scan->token[scan->tokenLen] = '\0';
+  v = strtof(scan->token, &end);
+  if (scan->tokenOverflow || end == scan->token || *end != '\0' || !isfinite(v)) {
+
+    t->value = MISSING_VALUE;
+    t->invalid = true;
+    return;
+  }
+
+  t->value = v;
+  t->found = true;
+}
+
+static bool push(JsonScan* scan, uint8_t container)
+{
+  if (scan->depth >= JSON_SCAN_MAX_DEPTH)
+    return false;
+
+  scan->containers[scan->depth] = container;
+  scan->basePathLen[scan->depth] = scan->pathLen;
+  scan->depth++;
+  return true;
+}
+
+static bool pop(JsonScan* scan, uint8_t container)
+{
+  if (scan->depth == 0 || scan->containers[scan->depth - 1] != container)
+    return false;
+
+  scan->depth--;
+  scan->pathLen = scan->basePathLen[scan->depth];
+  scan->pathTooLong = false;
+  scan->state = scan->depth ? S_AFTER_VALUE : S_DONE;
+  return true;
+}
+
+static void keyStart(JsonScan* scan)
+{
+  scan->pathLen = scan->basePathLen[scan->depth - 1];
+  scan->pathTooLong = scan->pathLen >= JSON_SCAN_MAX_PATH;
+  if (scan->pathLen > 0 && !scan->pathTooLong)
+    scan->path[scan->pathLen++] = '.';
+}
+
+static void keyChar(JsonScan* scan, char c)
+{
+  if (scan->pathLen >= JSON_SCAN_MAX_PATH) {
+
+    scan->pathTooLong = true;
+    return;
+  }
+
+  scan->path[scan->pathLen++] = c;
+}
+
+static void tokenChar(JsonScan* scan, char c)
+{
+  if (scan->tokenLen >= JSON_SCAN_MAX_TOKEN - 1) {
+
+    scan->tokenOverflow = true;
+    return;
+  }
+
+  scan->token[scan->tokenLen++] = c;
+}
+
+static bool valueStart(JsonScan* scan, char c)
+{
+  if (c == '{') {
+
+    invalidValue(scan);
+    if (!push(scan, '{'))
+      return false;
+
+    scan->state = S_KEY_OR_END;
+    return true;
+  }
+
+  if (c == '[') {
+
+    if (!push(scan, '['))
+      return false;
+
+    scan->state = S_VALUE_OR_END;
+    return true;
+  }
+
+  if (c == '"') {
+
+    invalidValue(scan);
+    scan->state = S_STRING;
+    return true;
+  }
+
+  scan->tokenLen = 0;
+  scan->tokenOverflow = false;
+
+  if (c == '-' || (c >= '0' && c <= '9')) {
+
+    tokenChar(scan, c);
+    scan->state = S_NUMBER;
+    return true;
+  }
+
+  if (c >= 'a' && c <= 'z') {
+
+    invalidValue(scan);
+    scan->state = S_LITERAL;
+    return true;
+  }
+
+  return false;
+}
+
+static bool valueEnd(JsonScan* scan)
+{
+  if (scan->depth == 0) {
+
+    scan->state = S_DONE;
+    return true;
+  }
+
+  if (scan->containers[scan->depth - 1] == '[')
+    scan->pathLen = scan->basePathLen[scan->depth - 1];
+
+  scan->state = S_AFTER_VALUE;
+  return true;
+}
+
+static bool step(JsonScan* scan, char c)
+{
+  switch (scan->state) {
+  case S_VALUE_OR_END:
+    if (IS_SPACE(c))
+      return true;
+
+    if (c == ']')
+      return pop(scan, '[');
+
+    return valueStart(scan, c);
+
+  case S_VALUE:
+    if (IS_SPACE(c))
+      return true;
+
+    return valueStart(scan, c);
+
+  case S_KEY_OR_END:
+    if (IS_SPACE(c))
+      return true;
+
+    if (c == '}')
+      return pop(scan, '{');
+
+  /* fall through */
+  case S_KEY_START:
+    if (IS_SPACE(c))
+      return true;
+
+    if (c != '"')
+      return false;
+
+    keyStart(scan);
+    scan->state = S_KEY;
+    return true;
+
+  case S_KEY:
+    if (c == '"')
+      scan->state = S_COLON;
+    else {
+
+      if (c == '\\')
+        scan->state = S_KEY_ESC;
+
+      keyChar(scan, c);
+    }
+
+    return true;
+
+  case S_KEY_ESC:
+    keyChar(scan, c);
+    scan->state = S_KEY;
+    return true;
+
+  case S_COLON:
+    if (IS_SPACE(c))
+      return true;
+
+    if (c != ':')
+      return false;
+
+    scan->state = S_VALUE;
+    return true;
+
+  case S_STRING:
+    if (c == '"')
+      return valueEnd(scan);
+
+    if (c == '\\')
+      scan->state = S_STRING_ESC;
+
+    return true;
+
+  case S_STRING_ESC:
+    scan->state = S_STRING;
+    return true;
+
+  case S_NUMBER:
+    if ((c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E') {
+
+      tokenChar(scan, c);
+      return true;
+    }
+
+    numberValue(scan);
+    valueEnd(scan);
+    return step(scan, c);
+
+  case S_LITERAL:
+    if (c >= 'a' && c <= 'z')
+      return true;
+
+    valueEnd(scan);
+    return step(scan, c);
+
+  case S_AFTER_VALUE:
+    if (IS_SPACE(c))
+      return true;
+
+    if (c == ',') {
+
+      scan->state = scan->containers[scan->depth - 1] == '{' ? S_KEY_START : S_VALUE;
+      return true;
+    }
+
+    if (c == '}')
+      return pop(scan, '{');
+
+    if (c == ']')
+      return pop(scan, '[');
+
+    return false;
+
+  case S_DONE:
+    return IS_SPACE(c);
+  }
+
+  return false;
+}
+
+/*
+ * Feed next piece of input to scanner. Returns -1 if
+ * input is not valid json or nesting is too deep.
+ */
+int jsonScanFeed(JsonScan* scan, const uint8_t* data, int len)
+{
+  if (scan->error)
+    return -1;
+
+  while (len-- > 0) {
+
+    if (!step(scan, (char)*data++)) {
+
+      scan->error = true;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Signal end of input. Flushes number at top level and
+ * checks that complete json document was seen.
+ */
+int jsonScanEnd(JsonScan* scan)
+{
+  if (scan->error)
+    return -1;
+
+  if (scan->state == S_NUMBER && scan->depth == 0) {
+
+    numberValue(scan);
+    scan->state = S_DONE;
+  }
+
+  if (scan->state != S_DONE) {
+
+    scan->error = true;
+    return -1;
+  }
+
+  return 0;
+}
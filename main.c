@@ -109,6 +109,7 @@ static void tcpipInitDone(void *arg)
             ethernetif_init,
             tcpip_input);
 
+  netif_set_status_callback(&defaultIf, ifStatusCallback);
   netif_set_default(&defaultIf);
 /*
  * Signal main thread that we are done.
@@ -116,27 +117,36 @@ static void tcpipInitDone(void *arg)
   sys_sem_signal(sem);
 }
 
-static void mainTask(void* arg)
+static void fsStage()
 {
-  sys_sem_t sem;
-
-  uosInit();
-  uosBootDiag();
- 
-  devTreeInit();
   fsInit();
   initConfig();
+}
+
+static void oneWireStage()
+{
   init1Wire();
-  potatoInit();
+}
+
+static void guiStage()
+{
   guiInit();
+  guiStart();
+}
+
+static void wifiStage()
+{
+  sys_sem_t sem;
 
   netInit();
 
 #if BUNDLE_FIRMWARE
 /* 
- * Provide a filesystem which contains Wifi firmware to Wiced driver.
+ * Provide a filesystem which contains compressed Wifi firmware and
+ * expand it to spiffs for Wiced driver, if not already there.
  */
   uosMountRom("/firmware", romFiles);
+  fwExpand(false);
 #endif
 
   if(sys_sem_new(&sem, 0) != ERR_OK) {
@@ -149,10 +159,63 @@ static void mainTask(void* arg)
   tcpip_init(tcpipInitDone, &sem);
   sys_sem_wait(&sem);
   nosPrintf("TCP/IP initialized.\n");
-  checkAP();
+}
 
+static void netStage()
+{
+  connStart();
   eshStartTelnetd();
-  guiStart();
+}
+
+static void sensorStage()
+{
+  sensorStart();
+  pulseStart();
+}
+
+/*
+ * Boot stages and their dependencies. Stages that configure
+ * GPIO pins (wifi driver sets up SDIO and WLAN pins) are
+ * chained, as GPIO_Init updates port registers without locking.
+ * Sensor stage (pulse input pin and 1-wire polling) waits for
+ * wifi. Filesystem mount overlaps with 1-wire and display setup.
+ * Stack sizes of fs, wifi and net keep the margin of old
+ * main task.
+ */
+enum {
+  STAGE_FS,
+  STAGE_ONEWIRE,
+  STAGE_GUI,
+  STAGE_WIFI,
+  STAGE_NET,
+  STAGE_SENSOR,
+  STAGE_COUNT
+};
+
+static BootStage stages[STAGE_COUNT] = {
+
+  [STAGE_FS]      = { "fs",      fsStage,      { NULL }, 5000 },
+  [STAGE_ONEWIRE] = { "1-wire",  oneWireStage, { NULL }, 1024 },
+  [STAGE_GUI]     = { "gui",     guiStage,     { &stages[STAGE_ONEWIRE] }, 1024 },
+  [STAGE_WIFI]    = { "wifi",    wifiStage,    { &stages[STAGE_FS], &stages[STAGE_ONEWIRE], &stages[STAGE_GUI] }, 5000 },
+  [STAGE_NET]     = { "net",     netStage,     { &stages[STAGE_WIFI] }, 5000 },
+  [STAGE_SENSOR]  = { "sensor",  sensorStage,  { &stages[STAGE_WIFI] }, 1024 },
+};
+
+static void mainTask(void* arg)
+{
+  uosInit();
+  uosBootDiag();
+  cycleInit();
+  memInit();
+ 
+  devTreeInit();
+  channelInit();
+  schedInit();
+  schedStart();
+  sleepInit();
+
+  bootRun(stages, STAGE_COUNT);
 
 /*
  * Enable sleep. It is initially enabled in pico]OS, but Wiced
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Firmware update over tcp. Image is fetched from update
+ * server (see tools/otaserve.py) into a staging file in spiffs.
+ * Receiving and flash programming run in separate tasks
+ * with two buffers between them, so next buffer is received
+ * while previous one is being programmed. When crc of the
+ * staged image checks out, marker file is written. Nothing
+ * installs staged image yet, that needs a bootloader
+ * which is not part of this project.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "eshell.h"
+#include "emw-meter.h"
+
+#define OTA_PORT   "4242"
+#define OTA_BUF    BUFFER_POOL_SIZE
+#define OTA_BUFS   2
+#define OTA_FILE   "/flash/ota.bin"
+#define OTA_READY  "/flash/ota.ready"
+#define OTA_MAX    (480 * 1024)
+
+enum {
+  OTA_IDLE,
+  OTA_RUNNING,
+  OTA_DONE,
+  OTA_FAILED
+};
+
+static const char* const stateNames[] = {
+  "idle", "running", "done", "failed"
+};
+
+typedef struct {
+
+  int      len;
+  uint8_t* data;
+} OtaBuf;
+
+static OtaBuf    bufs[OTA_BUFS];
+static POSSEMA_t freeSema;
+static POSSEMA_t fullSema;
+static POSSEMA_t doneSema;
+
+static char     otaHost[40];
+static char     otaPort[8];
+static int      otaState = OTA_IDLE;
+static bool     writeError;
+static uint32_t imageLen;
+static uint32_t imageCrc;
+static uint32_t received;
+static uint32_t written;
+static uint32_t writtenCrc;
+static JIF_t    otaStart;
+static JIF_t    otaEnd;
+static JIF_t    recvWait;
+static JIF_t    progWait;
+
+static uint32_t get32(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int recvFull(int sock, uint8_t* buf, int len)
+{
+  int got = 0;
+  int n;
+
+  while (got < len) {
+
+    n = recv(sock, buf + got, len - got, 0);
+    if (n <= 0)
+      return -1;
+
+    got += n;
+  }
+
+  return got;
+}
+
+/*
+ * Program buffers to staging file as they get filled.
+ * Buffer with zero or negative length ends the update.
+ * All buffers are consumed even after write error,
+ * so that receiver never gets stuck.
+ */
+static void programTask(void* arg)
+{
+  OtaBuf* b;
+  JIF_t t;
+  int fd;
+  int i = 0;
+
+  uosFileUnlink(OTA_FILE);
+  fd = open(OTA_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1)
+    writeError = true;
+
+  while (true) {
+
+    t = jiffies;
+    posSemaGet(fullSema);
+    recvWait += jiffies - t;
+
+    b = &bufs[i];
+    if (b->len <= 0)
+      break;
+
+    if (!writeError) {
+
+      writtenCrc = crc32(writtenCrc, b->data, b->len);
+      if (write(fd, b->data, b->len) != b->len)
+        writeError = true;
+      else
+        written += b->len;
+    }
+
+    posSemaSignal(freeSema);
+    i = (i + 1) % OTA_BUFS;
+  }
+
+  if (fd != -1)
+    close(fd);
+
+  posSemaSignal(freeSema);
+  posSemaSignal(doneSema);
+}
+
+static int connectServer(void)
+{
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int sock;
+
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(otaHost, otaPort, &hints, &res) != 0 || res == NULL)
+    return -1;
+
+  sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sock >= 0 && connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+
+    close(sock);
+    sock = -1;
+  }
+
+  freeaddrinfo(res);
+  return sock;
+}
+
+/*
+ * Receive image header (magic, length and crc) and
+ * then image itself into buffers.
+ */
+static bool receive(int sock)
+{
+  uint8_t hdr[12];
+  OtaBuf* b;
+  JIF_t t;
+  int i = 0;
+  int n;
+  bool ok = true;
+
+  if (recvFull(sock, hdr, sizeof(hdr)) < 0 || memcmp(hdr, "OTA1", 4)) {
+
+    printf("ota: bad header.\n");
+    return false;
+  }
+
+  imageLen = get32(hdr + 4);
+  imageCrc = get32(hdr + 8);
+  if (imageLen == 0 || imageLen > OTA_MAX) {
+
+    printf("ota: bad image size %lu.\n", (unsigned long)imageLen);
+    return false;
+  }
+
+  nosTaskCreate(programTask, NULL, 2, 1536, "OtaProg");
+
+  while (received < imageLen && ok) {
+
+    t = jiffies;
+    posSemaGet(freeSema);
+    progWait += jiffies - t;
+
+    b = &bufs[i];
+    n = imageLen - received;
+    if (n > OTA_BUF)
+      n = OTA_BUF;
+
+    if (writeError || recvFull(sock, b->data, n) < 0) {
+
+      b->len = -1;
+      ok = false;
+    }
+    else {
+
+      b->len = n;
+      received += n;
+    }
+
+    posSemaSignal(fullSema);
+    i = (i + 1) % OTA_BUFS;
+  }
+
+/*
+ * Tell programmer that image is complete and
+ * wait until it has finished.
+ */
+  if (ok) {
+
+    posSemaGet(freeSema);
+    bufs[i].len = 0;
+    posSemaSignal(fullSema);
+  }
+
+  posSemaGet(doneSema);
+  return ok && !writeError;
+}
+
+static bool verify(void)
+{
+  uint32_t crc;
+  char buf[24];
+  int fd;
+  int len;
+
+  if (writtenCrc != imageCrc) {
+
+    printf("ota: crc mismatch.\n");
+    return false;
+  }
+
+  if (fileCrc(OTA_FILE, bufs[0].data, OTA_BUF, &crc) < 0 || crc != imageCrc) {
+
+    printf("ota: staged image does not verify.\n");
+    return false;
+  }
+
+  fd = open(OTA_READY, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1)
+    return false;
+
+  len = sprintf(buf, "%lu %08lx\n", (unsigned long)imageLen, (unsigned long)imageCrc);
+  if (write(fd, buf, len) != len) {
+
+    close(fd);
+    return false;
+  }
+
+  close(fd);
+  return true;
+}
+
+static void otaTask(void* arg)
+{
+  int sock;
+  int i;
+  bool ok = true;
+
+  uosFileUnlink(OTA_READY);
+  for (i = 0; i < OTA_BUFS; i++) {
+
+    bufs[i].data = poolAlloc(&bufferPool);
+    if (bufs[i].data == NULL)
+      ok = false;
+  }
+
+  if (!ok)
+    printf("ota: no buffers.\n");
+  else {
+
+    sock = connectServer();
+    if (sock < 0) {
+
+      printf("ota: cannot connect to %s:%s.\n", otaHost, otaPort);
+      ok = false;
+    }
+    else {
+
+      ok = receive(sock) && verify();
+      close(sock);
+    }
+  }
+
+  for (i = 0; i < OTA_BUFS; i++) {
+
+    poolFree(&bufferPool, bufs[i].data);
+    bufs[i].data = NULL;
+  }
+
+  otaEnd = jiffies;
+  otaState = ok ? OTA_DONE : OTA_FAILED;
+  printf("ota: %s, %lu bytes in %lu ms.\n", stateNames[otaState],
+         (unsigned long)written, (unsigned long)((otaEnd - otaStart) * 1000 / HZ));
+}
+
+static int ota(EshContext* ctx)
+{
+  char* port = eshNamedArg(ctx, "port", true);
+  char* host = eshNextArg(ctx, true);
+  unsigned long ms;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (host == NULL) {
+
+    ms = ((otaState == OTA_RUNNING ? jiffies : otaEnd) - otaStart) * 1000 / HZ;
+    eshPrintf(ctx, "Update %s, %lu/%lu bytes received, %lu written in %lu ms.\n",
+              stateNames[otaState], (unsigned long)received, (unsigned long)imageLen,
+              (unsigned long)written, ms);
+
+    if (otaState != OTA_IDLE)
+      eshPrintf(ctx, "Waited %lu ms for network, %lu ms for flash.\n",
+                (unsigned long)(recvWait * 1000 / HZ), (unsigned long)(progWait * 1000 / HZ));
+
+    return 0;
+  }
+
+  if (otaState == OTA_RUNNING) {
+
+    eshPrintf(ctx, "Update already running.\n");
+    return -1;
+  }
+
+  if (freeSema == NULL) {
+
+    freeSema = posSemaCreate(OTA_BUFS);
+    fullSema = posSemaCreate(0);
+    doneSema = posSemaCreate(0);
+  }
+
+  snprintf(otaHost, sizeof(otaHost), "%s", host);
+  snprintf(otaPort, sizeof(otaPort), "%s", port ? port : OTA_PORT);
+
+  writeError = false;
+  imageLen = 0;
+  received = 0;
+  written = 0;
+  writtenCrc = 0;
+  recvWait = 0;
+  progWait = 0;
+  otaStart = jiffies;
+  otaState = OTA_RUNNING;
+
+  nosTaskCreate(otaTask, NULL, 2, 1536, "Ota");
+  return 0;
+}
+
+const EshCommand otaCommand = {
+  .flags = 0,
+  .name = "ota",
+  .help = "[--port n] [server]\nfetch firmware update from server to /flash (not installed), without server show status",
+  .handler = ota
+};
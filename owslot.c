@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * 1-Wire link layer functions of picoos-ow on top of
+ * uart style slot transfer (owuart.c, or simulator in
+ * tools/host). Write 1 and read slots are 0xff, which
+ * leaves bus low only during start bit. Write 0 slot is
+ * 0x00. Slot reads back as 0xff only if no device pulled
+ * bus low.
+ *
+ * This replaces GPIO bit-banging link layer of picoos-ow,
+ * which is then left out of library build.
+ */
+
+#include <picoos.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <picoos-ow.h>
+#include <owcfg.h>
+
+#include "emw-meter.h"
+
+#if OWCFG_USART
+
+/*
+ * Reset pulse is 0xf0 at 9600 baud. If there is
+ * a device on bus, its presence pulse changes
+ * the character that is read back.
+ */
+SMALLINT owTouchReset(int portnum)
+{
+  uint8_t slot = 0xf0;
+
+  if (!owUartTransfer(&slot, 1, true))
+    return FALSE;
+
+  return slot != 0xf0;
+}
+
+SMALLINT owTouchBit(int portnum, SMALLINT sendbit)
+{
+  uint8_t slot = sendbit ? 0xff : 0x00;
+
+  if (!owUartTransfer(&slot, 1, false))
+    return 0;
+
+  return slot == 0xff;
+}
+
+SMALLINT owTouchByte(int portnum, SMALLINT sendbyte)
+{
+  uint8_t slots[8];
+  int i;
+  SMALLINT result = 0;
+
+  for (i = 0; i < 8; i++)
+    slots[i] = (sendbyte & (1 << i)) ? 0xff : 0x00;
+
+  if (!owUartTransfer(slots, 8, false))
+    return 0xff;
+
+  for (i = 0; i < 8; i++)
+    if (slots[i] == 0xff)
+      result |= 1 << i;
+
+  return result;
+}
+
+SMALLINT owWriteByte(int portnum, SMALLINT sendbyte)
+{
+  return owTouchByte(portnum, sendbyte) == (sendbyte & 0xff);
+}
+
+SMALLINT owReadByte(int portnum)
+{
+  return owTouchByte(portnum, 0xff);
+}
+
+SMALLINT owSpeed(int portnum, SMALLINT new_speed)
+{
+  return MODE_NORMAL;
+}
+
+SMALLINT owProgramPulse(int portnum)
+{
+  return FALSE;
+}
+
+SMALLINT owWriteBytePower(int portnum, SMALLINT sendbyte)
+{
+  if (!owWriteByte(portnum, sendbyte))
+    return FALSE;
+
+  owLevel(portnum, MODE_STRONG5);
+  return TRUE;
+}
+
+SMALLINT owReadBitPower(int portnum, SMALLINT applyPowerResponse)
+{
+  if (owTouchBit(portnum, 1) != applyPowerResponse)
+    return FALSE;
+
+  owLevel(portnum, MODE_STRONG5);
+  return TRUE;
+}
+
+SMALLINT owHasPowerDelivery(int portnum)
+{
+  return TRUE;
+}
+
+SMALLINT owHasOverDrive(int portnum)
+{
+  return FALSE;
+}
+
+SMALLINT owHasProgramPulse(int portnum)
+{
+  return FALSE;
+}
+
+#endif
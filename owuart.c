@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * USART6 in half-duplex mode as 1-Wire bus master.
+ * Each time slot is one USART character, so bus timing
+ * is generated by hardware and bytes are moved with DMA
+ * while the calling task sleeps on a semaphore. Reset
+ * uses 9600 baud, bit slots 115200 baud. Slot encoding
+ * of link layer functions is in owslot.c.
+ */
+
+#include <picoos.h>
+#include <stdbool.h>
+#include <string.h>
+#include <picoos-ow.h>
+#include <owcfg.h>
+#include "devtree.h"
+#include "emw-meter.h"
+
+#if OWCFG_USART
+
+#include "stm32f4xx.h"
+
+#define RESET_BAUD   9600
+#define SLOT_BAUD    115200
+#define XFER_TIMEOUT 20
+
+static POSSEMA_t xferDone;
+static uint32_t pclk;
+static int level = MODE_NORMAL;
+
+static void setBaud(int baud)
+{
+  USART6->BRR = (pclk + baud / 2) / baud;
+}
+
+/*
+ * Bus pin as open-drain usart output, or driven high
+ * for strong pullup.
+ */
+static void setPin(bool strong)
+{
+  GPIO_InitTypeDef GPIO_InitStructure;
+
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_11;
+  GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+  if (strong) {
+
+    GPIO_SetBits(GPIOA, GPIO_Pin_11);
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+  }
+  else {
+
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+  }
+
+  GPIO_Init(GPIOA, &GPIO_InitStructure);
+}
+
+void owUartInit()
+{
+  USART_InitTypeDef USART_InitStructure;
+  RCC_ClocksTypeDef clocks;
+
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA | RCC_AHB1Periph_DMA2, ENABLE);
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART6, ENABLE);
+
+  GPIO_PinAFConfig(GPIOA, GPIO_PinSource11, GPIO_AF_USART6);
+  setPin(false);
+
+  RCC_GetClocksFreq(&clocks);
+  pclk = clocks.PCLK2_Frequency;
+
+  USART_InitStructure.USART_BaudRate = SLOT_BAUD;
+  USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+  USART_InitStructure.USART_StopBits = USART_StopBits_1;
+  USART_InitStructure.USART_Parity = USART_Parity_No;
+  USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+  USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+  USART_Init(USART6, &USART_InitStructure);
+  USART_HalfDuplexCmd(USART6, ENABLE);
+  USART_DMACmd(USART6, USART_DMAReq_Rx | USART_DMAReq_Tx, ENABLE);
+  USART_Cmd(USART6, ENABLE);
+
+/*
+ * USART6 RX is DMA2 stream 1 channel 5, TX stream 6 channel 5.
+ * Only RX completion is interesting, as in half-duplex mode
+ * every transmitted character is also received.
+ */
+  DMA2_Stream1->PAR = (uint32_t)&USART6->DR;
+  DMA2_Stream1->CR = DMA_Channel_5 | DMA_DIR_PeripheralToMemory | DMA_SxCR_MINC | DMA_SxCR_TCIE;
+  DMA2_Stream6->PAR = (uint32_t)&USART6->DR;
+  DMA2_Stream6->CR = DMA_Channel_5 | DMA_DIR_MemoryToPeripheral | DMA_SxCR_MINC;
+
+  xferDone = posSemaCreate(0);
+
+  NVIC_SetPriority(DMA2_Stream1_IRQn, PORTCFG_API_MAX_PRI);
+  NVIC_EnableIRQ(DMA2_Stream1_IRQn);
+}
+
+void DMA2_Stream1_irq()
+{
+  c_pos_intEnter();
+
+  if (DMA2->LISR & DMA_LISR_TCIF1) {
+
+    DMA2->LIFCR = DMA_LIFCR_CTCIF1;
+    posSemaSignal(xferDone);
+  }
+
+  c_pos_intExit();
+}
+
+/*
+ * Disable stream and wait until it has really stopped,
+ * registers cannot be changed before that.
+ */
+static void streamStop(DMA_Stream_TypeDef* stream)
+{
+  stream->CR &= ~DMA_SxCR_EN;
+  while (stream->CR & DMA_SxCR_EN)
+    ;
+}
+
+/*
+ * Send slots in buffer and replace them with
+ * what was read back from bus. Reset slot is
+ * sent with lower baud rate.
+ */
+bool owUartTransfer(uint8_t* buf, int len, bool reset)
+{
+  bool ok = true;
+
+  if (level != MODE_NORMAL)
+    owLevel(0, MODE_NORMAL);
+
+/*
+ * Previous transfer may have timed out, make sure
+ * that its late completion is not taken as this one.
+ */
+  streamStop(DMA2_Stream1);
+  streamStop(DMA2_Stream6);
+  while (posSemaWait(xferDone, 0) == 0)
+    ;
+
+  (void)USART6->SR;
+  (void)USART6->DR;
+
+  DMA2->LIFCR = DMA_LIFCR_CTCIF1 | DMA_LIFCR_CHTIF1 | DMA_LIFCR_CTEIF1 | DMA_LIFCR_CDMEIF1 | DMA_LIFCR_CFEIF1;
+  DMA2->HIFCR = DMA_HIFCR_CTCIF6 | DMA_HIFCR_CHTIF6 | DMA_HIFCR_CTEIF6 | DMA_HIFCR_CDMEIF6 | DMA_HIFCR_CFEIF6;
+
+  DMA2_Stream1->M0AR = (uint32_t)buf;
+  DMA2_Stream1->NDTR = len;
+  DMA2_Stream6->M0AR = (uint32_t)buf;
+  DMA2_Stream6->NDTR = len;
+
+  if (reset)
+    setBaud(RESET_BAUD);
+
+  DMA2_Stream1->CR |= DMA_SxCR_EN;
+  DMA2_Stream6->CR |= DMA_SxCR_EN;
+
+  if (posSemaWait(xferDone, MS(XFER_TIMEOUT)) != 0 || DMA2_Stream1->NDTR != 0)
+    ok = false;
+
+  streamStop(DMA2_Stream1);
+  streamStop(DMA2_Stream6);
+  if (reset)
+    setBaud(SLOT_BAUD);
+
+  return ok;
+}
+
+/*
+ * Strong pullup is done by switching bus pin
+ * to push-pull output.
+ */
+SMALLINT owLevel(int portnum, SMALLINT new_level)
+{
+  if (new_level == MODE_STRONG5) {
+
+    setPin(true);
+    level = MODE_STRONG5;
+  }
+  else if (new_level == MODE_NORMAL) {
+
+    setPin(false);
+    level = MODE_NORMAL;
+  }
+
+  return level;
+}
+
+void msDelay(int len)
+{
+  posTaskSleep(MS(len));
+}
+
+long msGettick()
+{
+  return jiffies * 1000 / HZ;
+}
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Fixed size block pools and bump arenas. Large temporary
+ * buffers (flash copy, firmware expansion, ota) come from
+ * a pool instead of heap, so they cannot fragment heap that
+ * is shared with wifi driver. Arena is scratch memory for
+ * handling one message, it is reset after each message.
+ * Arena has single owner task and no locking.
+ *
+ * There are no separate mqtt packet or lwip pools here.
+ * Potato-bus client keeps packets in its own static buffer,
+ * and mqtt scratch data comes from message arena. Lwip
+ * pbufs, pcbs and segments already come from its memp
+ * pools (sized in lwipopts.h), only PBUF_RAM and dhcp
+ * state use mem_malloc, which is mapped to heap.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <malloc.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+#define ARENA_ALIGN 4
+
+static uint8_t bufferStorage[BUFFER_POOL_COUNT][BUFFER_POOL_SIZE] __attribute__((aligned(8)));
+static uint8_t messageStorage[MESSAGE_ARENA_SIZE] __attribute__((aligned(8)));
+
+Pool bufferPool = {
+  .name = "buffer",
+  .blockSize = BUFFER_POOL_SIZE,
+  .blockCount = BUFFER_POOL_COUNT,
+  .storage = &bufferStorage[0][0]
+};
+
+Arena messageArena = {
+  .name = "message",
+  .buf = messageStorage,
+  .size = MESSAGE_ARENA_SIZE
+};
+
+static Pool* const pools[] = { &bufferPool };
+static Arena* const arenas[] = { &messageArena };
+
+#define POOL_COUNT  (int)(sizeof(pools) / sizeof(pools[0]))
+#define ARENA_COUNT (int)(sizeof(arenas) / sizeof(arenas[0]))
+
+/*
+ * Link all blocks to free list. First word
+ * of free block points to next one.
+ */
+static void poolInit(Pool* p)
+{
+  int i;
+  uint8_t* block;
+
+  p->freeList = NULL;
+  for (i = p->blockCount - 1; i >= 0; i--) {
+
+    block = p->storage + i * p->blockSize;
+    *(void**)block = p->freeList;
+    p->freeList = block;
+  }
+}
+
+void memInit()
+{
+  int i;
+
+  for (i = 0; i < POOL_COUNT; i++)
+    poolInit(pools[i]);
+}
+
+void* poolAlloc(Pool* p)
+{
+  void* block;
+  POS_LOCKFLAGS;
+
+  POS_SCHED_LOCK;
+  block = p->freeList;
+  if (block == NULL)
+    ++p->failures;
+  else {
+
+    p->freeList = *(void**)block;
+    if (++p->used > p->highWater)
+      p->highWater = p->used;
+  }
+
+  POS_SCHED_UNLOCK;
+  return block;
+}
+
+void poolFree(Pool* p, void* block)
+{
+  POS_LOCKFLAGS;
+
+  if (block == NULL)
+    return;
+
+  POS_SCHED_LOCK;
+  *(void**)block = p->freeList;
+  p->freeList = block;
+  --p->used;
+  POS_SCHED_UNLOCK;
+}
+
+void* arenaAlloc(Arena* a, int size)
+{
+  void* ptr;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (a->used + size > a->size) {
+
+    ++a->failures;
+    return NULL;
+  }
+
+  ptr = a->buf + a->used;
+  a->used += size;
+  if (a->used > a->highWater)
+    a->highWater = a->used;
+
+  return ptr;
+}
+
+void arenaReset(Arena* a)
+{
+  a->used = 0;
+}
+
+static int mem(EshContext* ctx)
+{
+  struct mallinfo mi;
+  Pool* p;
+  Arena* a;
+  int i;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  eshPrintf(ctx, "%-8s %6s %5s %5s %5s %6s\n", "pool", "size", "count", "used", "max", "failed");
+  for (i = 0; i < POOL_COUNT; i++) {
+
+    p = pools[i];
+    eshPrintf(ctx, "%-8s %6d %5d %5d %5d %6lu\n",
+              p->name, p->blockSize, p->blockCount, p->used, p->highWater,
+              (unsigned long)p->failures);
+  }
+
+  eshPrintf(ctx, "%-8s %6s %5s %5s %5s %6s\n", "arena", "size", "", "used", "max", "failed");
+  for (i = 0; i < ARENA_COUNT; i++) {
+
+    a = arenas[i];
+    eshPrintf(ctx, "%-8s %6d %5s %5d %5d %6lu\n",
+              a->name, a->size, "", a->used, a->highWater,
+              (unsigned long)a->failures);
+  }
+
+  mi = mallinfo();
+  eshPrintf(ctx, "heap %d bytes, %d in use, %d free.\n", mi.arena, mi.uordblks, mi.fordblks);
+  return 0;
+}
+
+const EshCommand memCommand = {
+  .flags = 0,
+  .name = "mem",
+  .help = "show memory pool, arena and heap usage",
+  .handler = mem
+};
@@ -29,28 +29,34 @@
  */
 
 #include <picoos.h>
+#include <picoos-u.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include <math.h>
 #include <eshell.h>
 
 #include "wwd_wifi.h"
 
+#include "lwip/sockets.h"
 #include "potato-bus.h"
-#include "potato-json.h"
 #include "emw-meter.h"
 
-static const char* SENSOR_EMW_METER = "sensor/emw-meter";
-static const char* FORECAST_FMI = "forecast/fmi";
-static const char* TS_EMETER = "ts/emeter";
-static const char* TS_DAVIS_HOME = "ts/davis/home";
+static const char SENSOR_EMW_METER[] = "sensor/emw-meter";
+static const char FORECAST_FMI[] = "forecast/fmi";
+static const char TS_EMETER[] = "ts/emeter";
+static const char TS_DAVIS_HOME[] = "ts/davis/home";
+static const char SENSOR_EMW_METER_SLEEP[] = "sensor/emw-meter/sleep";
 
-int16_t outsideStats[MAX_STATS];
-int16_t insideStats[MAX_STATS];
-int16_t powerStats[MAX_STATS];
+/*
+ * Probe topic contains client id, so that meters don't
+ * answer each other's probes. Id has fixed length and
+ * is filled in when client starts.
+ */
+static char probeTopic[] = "sensor/emw-meter/EMW000000000000/probe";
 
 extern wiced_mac_t   myMac;
 
@@ -95,89 +101,611 @@ const SymbolFontMap fontMap[] = {
   { 'a', 92 },
 };
 
-double outsideTemperature = MISSING_VALUE;
-double insideTemperature = MISSING_VALUE;
-int power = MISSING_VALUE;
 int weatherSymbol3 = 0;
 char weatherSymbol = 0;
 
 static PbClient client;
 
+#define KEEPALIVE 60
+
 /*
  * Configure mqtt client.
  */
 static int mqtt(EshContext* ctx)
 {
   char* server = eshNamedArg(ctx, "server", true);
+  char* cbor = eshNamedArg(ctx, "cbor", true);
 
   eshCheckNamedArgsUsed(ctx);
   eshCheckArgsUsed(ctx);
   if (eshArgError(ctx) != EshOK)
     return -1;
 
-  uosConfigSet("mqtt.server", server);
+  if (server != NULL)
+    uosConfigSet("mqtt.server", server);
+
+  if (cbor != NULL)
+    uosConfigSet("mqtt.cbor", cbor);
+
   return 0;
 }
 
 const EshCommand mqttCommand = {
   .flags = 0,
   .name = "mqtt",
-  .help = "--server servername configure mqtt client",
+  .help = "--server servername --cbor topic,topic\nconfigure mqtt client, listed topics use cbor encoding",
   .handler = mqtt
 }; 
 
-static JsonContext ctx;
+static void updatePower(float value)
+{
+  channelSet(&powerChannel, value);
+  channelSample(&powerChannel);
+}
 
-static float findValue(char* msg, const char* location, const char* sensor)
+static void updateForecast(float value)
 {
-  JsonNode* node;
+  channelLock();
+  if (IS_MISSING(value)) {
 
-  node = jsonParse(&ctx, msg);
-  if (node == NULL)
-    return MISSING_VALUE;
+    weatherSymbol3 = 0;
+    weatherSymbol  = 0;
+  }
+  else {
 
-  node = jsonFind(node, "locations");
-  if (node == NULL)
-    return MISSING_VALUE;
+    weatherSymbol3 = (int)value;
+    unsigned int i;
+    bool found = false;
 
-  node = jsonFind(node, location);
-  if (node == NULL)
-    return MISSING_VALUE;
+    for (i = 0; i < sizeof(fontMap) / sizeof(SymbolFontMap); i++) {
 
-  node = jsonFind(node, sensor);
-  if (node == NULL)
-    return MISSING_VALUE;
+      if (fontMap[i].weatherSymbol3 == weatherSymbol3) {
+
+        weatherSymbol = fontMap[i].ch;
+        found = true;
+        break;
+      }
+    }
+
+    if (!found)
+      weatherSymbol = 0;
+  }
+
+  channelUnlock();
+}
+
+/*
+ * Latency probe. When enabled, keepalive is done by
+ * publishing a sequence number to probe topic, which we
+ * also subscribe. Time until it comes back is mqtt
+ * round trip latency.
+ */
+static uint32_t probeSeq;
+static JIF_t probeSent;
+static bool probePending;
+
+#define PROBE_SEQ_MAX (1 << 20)
+
+static void updateProbe(float value)
+{
+  if (probePending && !IS_MISSING(value) && (uint32_t)value == probeSeq) {
+
+    wifiLatency(jiffies - probeSent);
+    probePending = false;
+  }
+}
+
+/*
+ * Davis station messages drive history of
+ * both outside and inside temperatures.
+ */
+static void updateOutside(float value)
+{
+  channelSet(&outsideChannel, value);
+  channelSample(&outsideChannel);
+
+  if (!IS_MISSING(channelGet(&insideChannel)))
+    channelSample(&insideChannel);
+}
+
+typedef struct {
+
+  const char* topic;
+  int topicLen;
+  const char* path;
+  void (*update)(float value);
+} Subscription;
+
+#define TOPIC(t) t, sizeof(t) - 1
+
+/*
+ * Topics we are interested in and json path
+ * of value in each of them. Topics are compared
+ * as (pointer, length) views, so neither side needs
+ * to be nul-terminated.
+ */
+static const Subscription subscriptions[] = {
+
+  { TOPIC(TS_DAVIS_HOME), "locations.outside.temperature", updateOutside },
+  { TOPIC(TS_EMETER),     "locations.emeter.power",        updatePower },
+  { TOPIC(FORECAST_FMI),  "weatherSymbol3",                updateForecast },
+  { TOPIC(probeTopic),    "",                              updateProbe },
+};
+
+#define SUBSCRIPTION_COUNT (int)(sizeof(subscriptions) / sizeof(Subscription))
+
+static const Subscription* findSubscription(const char* topic, int len)
+{
+  int i;
+  const Subscription* sub;
+
+  for (i = 0, sub = subscriptions; i < SUBSCRIPTION_COUNT; i++, sub++)
+    if (sub->topicLen == len && !memcmp(sub->topic, topic, len))
+      return sub;
+
+  return NULL;
+}
+
+static int formatInside(char* buf, int max, float value, bool cbor);
+static int formatSleep(char* buf, int max, float value, bool cbor);
+
+typedef struct {
+
+  Channel*    channel;
+  const char* topic;
+  int       (*format)(char* buf, int max, float value, bool cbor);
+  PubPolicy   policy;
+  bool        cbor;
+  uint32_t    updates;
+} Outgoing;
+
+/*
+ * Channels published by us. Default policy publishes
+ * inside temperature when it changes by 0.1 degrees,
+ * at most every 10 seconds and at least every 10 minutes.
+ * Sleep statistics are sent when sleep percentage changes
+ * by 1 or at least every 15 minutes.
+ */
+static Outgoing outgoing[] = {
+
+  { &insideChannel, SENSOR_EMW_METER, formatInside,
+    { .name = "inside", .absBand = 0.1, .minInterval = 10, .maxInterval = 600 },
+    .cbor = false, .updates = 0 },
+  { &sleepChannel, SENSOR_EMW_METER_SLEEP, formatSleep,
+    { .name = "sleep", .absBand = 1, .minInterval = 60, .maxInterval = 900 },
+    .cbor = false, .updates = 0 },
+};
+
+#define OUTGOING_COUNT (int)(sizeof(outgoing) / sizeof(Outgoing))
+
+static bool policyReload = true;
+static JIF_t lastSend;
+
+/*
+ * Topics listed in comma separated mqtt.cbor config
+ * entry use cbor encoding instead of json.
+ */
+static bool cborTopics[SUBSCRIPTION_COUNT];
+
+static bool topicInList(const char* list, const char* topic, int len)
+{
+  int n;
+
+  if (list == NULL)
+    return false;
+
+  while (*list) {
 
-  if (!jsonIsArray(node))
+    n = strcspn(list, ",");
+    if (n == len && !memcmp(list, topic, len))
+      return true;
+
+    list += n;
+    if (*list == ',')
+      ++list;
+  }
+
+  return false;
+}
+
+static void loadEncodings(void)
+{
+  const char* list = uosConfigGet("mqtt.cbor");
+  int i;
+
+  for (i = 0; i < SUBSCRIPTION_COUNT; i++)
+    cborTopics[i] = topicInList(list, subscriptions[i].topic, subscriptions[i].topicLen);
+
+  for (i = 0; i < OUTGOING_COUNT; i++)
+    outgoing[i].cbor = topicInList(list, outgoing[i].topic, strlen(outgoing[i].topic));
+}
+
+/*
+ * Scanner for payload of subscribed topic,
+ * either json or cbor.
+ */
+typedef struct {
+
+  bool cbor;
+  JsonScanTarget target;
+  union {
+
+    JsonScan json;
+    CborScan cbor;
+  } u;
+} PayloadScan;
+
+static void payloadInit(PayloadScan* scan, const Subscription* sub)
+{
+  scan->cbor = cborTopics[sub - subscriptions];
+  scan->target.path = sub->path;
+
+  if (scan->cbor)
+    cborScanInit(&scan->u.cbor, &scan->target, 1);
+  else
+    jsonScanInit(&scan->u.json, &scan->target, 1);
+}
+
+static void payloadFeed(PayloadScan* scan, const uint8_t* data, int len)
+{
+  if (scan->cbor)
+    cborScanFeed(&scan->u.cbor, data, len);
+  else
+    jsonScanFeed(&scan->u.json, data, len);
+}
+
+/*
+ * Finish scanning. Values from truncated or
+ * malformed payload are not used.
+ */
+static float payloadEnd(PayloadScan* scan)
+{
+  int st;
+
+  if (scan->cbor)
+    st = cborScanEnd(&scan->u.cbor);
+  else
+    st = jsonScanEnd(&scan->u.json);
+
+  if (st < 0)
     return MISSING_VALUE;
 
-  float last = MISSING_VALUE;
+  return scan->target.value;
+}
+
+/*
+ * Scanner state and buffers for incoming messages and
+ * publish formatting come from message arena, which is
+ * reset for each event. Receive path does not use heap.
+ */
+#define PUBLISH_MAX 100
+
+/*
+ * Scan message that is completely in memory.
+ * Message is used as-is, without copying or nul-terminating it.
+ */
+static void scanPublish(const Subscription* sub, const uint8_t* msg, int len)
+{
+  PayloadScan* scan = arenaAlloc(&messageArena, sizeof(PayloadScan));
+
+  if (scan == NULL)
+    return;
 
-  while ((node = jsonNext(node)) != NULL) {
+  TRACE_BEGIN(TRACE_PARSE);
+  payloadInit(scan, sub);
+  payloadFeed(scan, msg, len);
+  sub->update(payloadEnd(scan));
+  TRACE_END(TRACE_PARSE);
+}
+
+#define STREAM_CHUNK     64
+#define STREAM_TOPIC_MAX 32
+
+static int readFully(int sock, uint8_t* buf, int len)
+{
+  int got;
 
-    if (!jsonIsNumber(node))
-      return MISSING_VALUE;
+  while (len > 0) {
 
-    last = jsonReadDouble(node);
+    got = read(sock, buf, len);
+    if (got <= 0)
+      return -1;
+
+    buf += got;
+    len -= got;
   }
 
-  return last;
+  return 0;
 }
 
+/*
+ * Receive publish message that doesn't fit into client
+ * packet buffer. When potato-bus returns PB_TOOBIG the fixed
+ * header has been consumed and the remaining length is left
+ * in packet.len, rest of message is still in socket.
+ * Read it in small chunks and feed them to streaming
+ * payload scanner so that memory usage stays bounded.
+ * Subscriptions are QoS 0, so there is no packet id.
+ */
+static int streamPublish(void)
+{
+  uint8_t* chunk = arenaAlloc(&messageArena, STREAM_CHUNK);
+  char* topic = arenaAlloc(&messageArena, STREAM_TOPIC_MAX);
+  PayloadScan* scan = arenaAlloc(&messageArena, sizeof(PayloadScan));
+  int remaining = client.packet.len;
+  int topicLen;
+  int len;
+  const Subscription* sub = NULL;
+
+  if (chunk == NULL || topic == NULL || scan == NULL)
+    return -1;
+
+  if (remaining < 2 || readFully(client.sock, chunk, 2) < 0)
+    return -1;
+
+  remaining -= 2;
+  topicLen = (chunk[0] << 8) | chunk[1];
+  if (topicLen > remaining)
+    return -1;
+
+  remaining -= topicLen;
+  if (topicLen <= STREAM_TOPIC_MAX) {
+
+    if (readFully(client.sock, (uint8_t*)topic, topicLen) < 0)
+      return -1;
+
+    sub = findSubscription(topic, topicLen);
+  }
+  else {
+
+    while (topicLen > 0) {
+
+      len = topicLen > STREAM_CHUNK ? STREAM_CHUNK : topicLen;
+      if (readFully(client.sock, chunk, len) < 0)
+        return -1;
+
+      topicLen -= len;
+    }
+  }
+
+  if (sub != NULL)
+    payloadInit(scan, sub);
+
+  while (remaining > 0) {
+
+    len = remaining > STREAM_CHUNK ? STREAM_CHUNK : remaining;
+    if (readFully(client.sock, chunk, len) < 0)
+      return -1;
+
+    remaining -= len;
+    if (sub != NULL)
+      payloadFeed(scan, chunk, len);
+  }
+
+  if (sub != NULL)
+    sub->update(payloadEnd(scan));
+
+  return 0;
+}
+
+/*
+ * Format inside temperature for publishing, as json
+ * or cbor depending on configuration.
+ */
+static int formatInside(char* buf, int max, float value, bool cbor)
+{
+  CborEnc enc;
+
+  if (!cbor) {
+
+    snprintf(buf, max,
+             "{\"locations\":{\"inside\":{\"livingRoom\":{\"temperature\":%5.1lf}}}}", value);
+    return strlen(buf);
+  }
+
+  cborEncInit(&enc, (uint8_t*)buf, max);
+  cborEncMap(&enc, 1);
+  cborEncText(&enc, "locations");
+  cborEncMap(&enc, 1);
+  cborEncText(&enc, "inside");
+  cborEncMap(&enc, 1);
+  cborEncText(&enc, "livingRoom");
+  cborEncMap(&enc, 1);
+  cborEncText(&enc, "temperature");
+  cborEncFloat(&enc, round(value * 10) / 10);
+  return cborEncEnd(&enc);
+}
+
+/*
+ * Format sleep statistics: percentage of time slept during
+ * last minute, total run, sleep and stop mode times in
+ * seconds and number of wakeups.
+ */
+static int formatSleep(char* buf, int max, float value, bool cbor)
+{
+  SleepStats st;
+  unsigned long wakeups = 0;
+  CborEnc enc;
+  int i;
+
+  sleepStats(&st);
+  for (i = 0; i < WAKE_SOURCES; i++)
+    wakeups += st.wakeups[i];
+
+  if (!cbor) {
+
+    snprintf(buf, max,
+             "{\"sleep\":%.1f,\"run\":%lu,\"light\":%lu,\"stop\":%lu,\"wakeups\":%lu}",
+             value,
+             (unsigned long)(st.run / 1000000),
+             (unsigned long)(st.sleep / 1000000),
+             (unsigned long)(st.deep / 1000000),
+             wakeups);
+    return strlen(buf);
+  }
+
+  cborEncInit(&enc, (uint8_t*)buf, max);
+  cborEncMap(&enc, 5);
+  cborEncText(&enc, "sleep");
+  cborEncFloat(&enc, round(value * 10) / 10);
+  cborEncText(&enc, "run");
+  cborEncInt(&enc, st.run / 1000000);
+  cborEncText(&enc, "light");
+  cborEncInt(&enc, st.sleep / 1000000);
+  cborEncText(&enc, "stop");
+  cborEncInt(&enc, st.deep / 1000000);
+  cborEncText(&enc, "wakeups");
+  cborEncInt(&enc, wakeups);
+  return cborEncEnd(&enc);
+}
+
+/*
+ * Publish values that policy lets through. Returns -1
+ * if connection is broken.
+ */
+static int publishOutgoing(PbPublish* pub, char* buf, int max)
+{
+  int i;
+  Outgoing* out;
+  float value;
+  uint32_t updates;
+  bool fresh;
+
+  if (policyReload) {
+
+    policyReload = false;
+    for (i = 0, out = outgoing; i < OUTGOING_COUNT; i++, out++)
+      pubPolicyLoad(&out->policy);
+  }
+
+  for (i = 0, out = outgoing; i < OUTGOING_COUNT; i++, out++) {
+
+    value = channelRead(out->channel, &updates);
+    fresh = updates != out->updates;
+    out->updates = updates;
+
+    if (!pubPolicyCheck(&out->policy, value, fresh))
+      continue;
+
+    pub->message = (uint8_t*)buf;
+    pub->len = out->format(buf, max, value, out->cbor);
+    pub->topic = out->topic;
+    if (pub->len < 0 || pbPublish(&client, pub) < 0)
+      return -1;
+
+    pubPolicySent(&out->policy, value);
+    lastSend = jiffies;
+  }
+
+  return 0;
+}
+
+/*
+ * Ping broker, or publish latency probe if it is enabled.
+ */
+static int sendKeepalive(PbPublish* pub, char* buf, int max)
+{
+  const char* probe = uosConfigGet("mqtt.probe");
+
+  if (probe == NULL || strcmp(probe, "1"))
+    return pbPing(&client);
+
+  probeSeq = (probeSeq + 1) % PROBE_SEQ_MAX;
+  pub->message = (uint8_t*)buf;
+  pub->len = snprintf(buf, max, "%lu", (unsigned long)probeSeq);
+  pub->topic = probeTopic;
+  probeSent = jiffies;
+  probePending = true;
+  return pbPublish(&client, pub);
+}
+
+/*
+ * When wifi power save is on, align receive timeout
+ * with radio wake period.
+ */
+static void setReceiveTimeout()
+{
+  JIF_t timeout = wifiReceiveTimeout();
+  struct timeval tv;
+
+  if (timeout == 0)
+    return;
+
+  tv.tv_sec = (timeout / HZ);
+  tv.tv_usec = (timeout % HZ) * (1000000 / HZ);
+  setsockopt(client.sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Show publish statistics or set publish policy.
+ */
+static int pubCmd(EshContext* ctx)
+{
+  char* name = eshNextArg(ctx, true);
+  char* policy = eshNextArg(ctx, true);
+  char key[24];
+  int i;
+  Outgoing* out;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (name != NULL) {
+
+    if (policy == NULL) {
+
+      eshPrintf(ctx, "Usage: pub [name abs,rel,min,max]\n");
+      return -1;
+    }
+
+    snprintf(key, sizeof(key), "pub.%s", name);
+    uosConfigSet(key, policy);
+    policyReload = true;
+    return 0;
+  }
+
+  eshPrintf(ctx, "name       sent suppressed    abs  rel%%   min   max\n");
+  for (i = 0, out = outgoing; i < OUTGOING_COUNT; i++, out++)
+    eshPrintf(ctx, "%-8s %6lu %10lu %6.2f %4.1f %5.0f %5.0f\n",
+              out->policy.name,
+              (unsigned long)out->policy.sent,
+              (unsigned long)out->policy.suppressed,
+              out->policy.absBand,
+              out->policy.relBand * 100,
+              out->policy.minInterval,
+              out->policy.maxInterval);
+
+  return 0;
+}
+
+const EshCommand pubCommand = {
+  .flags = 0,
+  .name = "pub",
+  .help = "[name abs,rel,min,max]\nshow publish statistics or set publish policy of channel",
+  .handler = pubCmd
+};
+
 static void potatoTask(void* arg)
 {
-  char jsonBuf[100];
-  int timeoutCount;
+  char clientId[20];
+  char* buf;
 
   while (true) {
 
-    sprintf(jsonBuf, "EMW%02x%02x%02x%02x%02x%02x", myMac.octet[0],
+    sprintf(clientId, "EMW%02x%02x%02x%02x%02x%02x", myMac.octet[0],
                 myMac.octet[1], myMac.octet[2], myMac.octet[3],
                 myMac.octet[4], myMac.octet[5]);
 
+    snprintf(probeTopic, sizeof(probeTopic), "%s/EMW%02x%02x%02x%02x%02x%02x/probe",
+             SENSOR_EMW_METER, myMac.octet[0],
+             myMac.octet[1], myMac.octet[2], myMac.octet[3],
+             myMac.octet[4], myMac.octet[5]);
+
     PbConnect cd = {};
-    cd.clientId = jsonBuf;
-    cd.keepAlive= 60;
+    cd.clientId = clientId;
+    cd.keepAlive= KEEPALIVE;
     const char* server = uosConfigGet("mqtt.server");
   
     if (server == NULL) {
@@ -194,31 +722,28 @@ static void potatoTask(void* arg)
     }
 
     PbPublish pub = {};
+
+    setReceiveTimeout();
+    loadEncodings();
   
 /*
- * Subscribe topics we are interested in.
+ * Subscribe topics we are interested in. Power is not
+ * taken from mqtt if local pulse counter provides it.
  */
     PbSubscribe sub = {};
-    sub.topic = TS_DAVIS_HOME;
-    if (pbSubscribe(&client, &sub) < 0) {
+    int i;
 
-      printf("potato: subscribe failed.\n");
-      pbDisconnect(&client);
-      posTaskSleep(MS(10000));
-      continue;
-    }
+    for (i = 0; i < SUBSCRIPTION_COUNT; i++) {
 
-    sub.topic = TS_EMETER;
-    if (pbSubscribe(&client, &sub) < 0) {
+      if (subscriptions[i].update == updatePower && pulseActive())
+        continue;
 
-      printf("potato: subscribe failed.\n");
-      pbDisconnect(&client);
-      posTaskSleep(MS(10000));
-      continue;
+      sub.topic = subscriptions[i].topic;
+      if (pbSubscribe(&client, &sub) < 0)
+        break;
     }
 
-    sub.topic = FORECAST_FMI;
-    if (pbSubscribe(&client, &sub) < 0) {
+    if (i < SUBSCRIPTION_COUNT) {
 
       printf("potato: subscribe failed.\n");
       pbDisconnect(&client);
@@ -231,108 +756,48 @@ static void potatoTask(void* arg)
 /*
  * Poll mqtt events.
  */ 
-    timeoutCount = 0;
+    lastSend = jiffies;
     while((type = pbEvent(&client))) {
 
-      if (type == PB_TIMEOUT) {
-/*
- * When receive times out, either send out room temperature
- * that has been read or at least keepalive message.
- */
-        if (!IS_MISSING(insideTemperature) && timeoutCount >= 5) {
-
-          timeoutCount = 0;
-          snprintf(jsonBuf, sizeof(jsonBuf),
-                   "{\"locations\":{\"inside\":{\"livingRoom\":{\"temperature\":%5.1lf}}}}", insideTemperature);
-          pub.message = (uint8_t*)jsonBuf;
-          pub.len = strlen(jsonBuf);
-          pub.topic = SENSOR_EMW_METER;
-          if (pbPublish(&client, &pub) < 0)
-            break;
-        }
-        else
-          if (pbPing(&client) < 0)
-            break;
+      arenaReset(&messageArena);
+      if (type == PB_TOOBIG) {
 
-        ++timeoutCount;
-        continue;
-      }
+        if (streamPublish() < 0) {
 
-      if (type == PB_TOOBIG) {
-   
-        printf ("potato: too big packet\n");
-        break;
+          printf ("potato: too big packet\n");
+          break;
+        }
       }
-  
-      if (type < 0)
-        break;
+      else if (type == PB_MQ_PUBLISH) {
  /*
   * Handle incoming data.
   */ 
-      if (type == PB_MQ_PUBLISH) {
-  
         pbReadPublish(&client.packet, &pub);
-        pub.message[pub.len] = '\0';
-
-        if (!strcmp(pub.topic, TS_EMETER)) {
-
-          potatoLock();
-          power = findValue((char*)pub.message, "emeter", "power");
-          memmove(powerStats, powerStats + 1, (MAX_STATS - 1) * sizeof(powerStats[0]));
-          powerStats[MAX_STATS - 1] = power;
-          potatoUnlock();
-        }
-
-        if (!strcmp(pub.topic, FORECAST_FMI)) {
-
-          JsonNode* root = jsonParse(&ctx, (char*)pub.message);
-
-          JsonNode* sym = jsonFind(root, "weatherSymbol3");
-
-          potatoLock();
-          if (!jsonIsNumber(sym)) {
- 
-            weatherSymbol3 = 0;
-            weatherSymbol  = 0;
-          }
-          else {
 
-            weatherSymbol3 = jsonReadInteger(sym);
-            unsigned int i;
-            bool found = false;
+        const Subscription* subscription = findSubscription(pub.topic, strlen(pub.topic));
 
-            for (i = 0; i < sizeof(fontMap) / sizeof(SymbolFontMap); i++) {
-
-              if (fontMap[i].weatherSymbol3 == weatherSymbol3) {
-
-                weatherSymbol = fontMap[i].ch;
-                found = true;
-                break;
-              }
-            }
-
-            if (!found)
-              weatherSymbol = 0;
-          }
-
-          potatoUnlock();
-        }
-
-        if (!strcmp(pub.topic, TS_DAVIS_HOME)) {
+        if (subscription != NULL)
+          scanPublish(subscription, pub.message, pub.len);
+      }
+      else if (type < 0 && type != PB_TIMEOUT)
+        break;
 
-          potatoLock();
-          outsideTemperature = findValue((char*)pub.message, "outside", "temperature");
-          memmove(outsideStats, outsideStats + 1, (MAX_STATS - 1) * sizeof(outsideStats[0]));
-          outsideStats[MAX_STATS - 1] = round(outsideTemperature * 10);
+/*
+ * Send out values that have changed enough, or at
+ * least keepalive message if nothing has been sent
+ * for half of keepalive period. With power save
+ * this happens at receive timeout, when radio is awake.
+ */
+      buf = arenaAlloc(&messageArena, PUBLISH_MAX);
+      if (buf == NULL || publishOutgoing(&pub, buf, PUBLISH_MAX) < 0)
+        break;
 
-          if (!IS_MISSING(insideTemperature)) {
+      if (jiffies - lastSend >= MS(KEEPALIVE * 1000 / 2)) {
 
-            memmove(insideStats, insideStats + 1, (MAX_STATS - 1) * sizeof(insideStats[0]));
-            insideStats[MAX_STATS - 1] = round(insideTemperature * 10);
-          }
+        if (sendKeepalive(&pub, buf, PUBLISH_MAX) < 0)
+          break;
 
-          potatoUnlock();
-        }
+        lastSend = jiffies;
       }
     }
   
@@ -343,22 +808,6 @@ static void potatoTask(void* arg)
 }
 
 static bool started = false;
-static POSMUTEX_t potatoMutex;
-void potatoInit()
-{
-  potatoMutex = posMutexCreate();
-  int i;
-  int16_t* sp;
-
-  for (sp = outsideStats, i = 0; i < MAX_STATS; i++, sp++)
-    *sp = MISSING_VALUE;
-
-  for (sp = insideStats, i = 0; i < MAX_STATS; i++, sp++)
-    *sp = MISSING_VALUE;
-
-  for (sp = powerStats, i = 0; i < MAX_STATS; i++, sp++)
-    *sp = MISSING_VALUE;
-}
 
 void potatoStart()
 {
@@ -369,13 +818,3 @@ void potatoStart()
 
   nosTaskCreate(potatoTask, NULL, 2, 4000, "PotatoBus");
 }
-
-void potatoLock()
-{
-  posMutexLock(potatoMutex);
-}
-
-void potatoUnlock()
-{
-  posMutexUnlock(potatoMutex);
-}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Wifi power save. Mode and listen interval come from
+ * config, wake period (how often radio listens for buffered
+ * frames) is used to align mqtt receive timeouts. Latency
+ * of mqtt round trips is collected per mode, so that
+ * cost of power saving can be seen.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <eshell.h>
+
+#include "wwd_wifi.h"
+#include "wiced-driver.h"
+
+#include "emw-meter.h"
+
+#define FAST_SLEEP_DELAY 200
+
+static const char* const modeNames[] = { "off", "ps", "fast" };
+
+static int mode;
+static int listenInterval = 1;
+static JIF_t wakePeriod;
+
+static uint32_t probes;
+static JIF_t latencyMin;
+static JIF_t latencyMax;
+static JIF_t latencySum;
+
+static void latencyClear()
+{
+  probes = 0;
+  latencyMin = 0;
+  latencyMax = 0;
+  latencySum = 0;
+}
+
+static void powerSaveConfig()
+{
+  const char* cfg;
+  int i;
+
+  mode = PS_OFF;
+  cfg = uosConfigGet("wifi.ps");
+  if (cfg != NULL)
+    for (i = 0; i < 3; i++)
+      if (!strcmp(cfg, modeNames[i]))
+        mode = i;
+
+  cfg = uosConfigGet("wifi.listen");
+  listenInterval = cfg ? atoi(cfg) : 1;
+  if (listenInterval < 1)
+    listenInterval = 1;
+}
+
+/*
+ * Enable configured power save mode. Called by
+ * connection manager, which owns wifi driver access.
+ */
+void wifiPowerSave()
+{
+  wl_bss_info_t apInfo;
+  wiced_security_t security;
+  int beacon = 100;
+  int dtim = 1;
+
+  powerSaveConfig();
+
+  if (wwd_wifi_get_ap_info(&apInfo, &security) == WWD_SUCCESS) {
+
+    if (apInfo.beacon_period)
+      beacon = apInfo.beacon_period;
+
+    if (apInfo.dtim_period)
+      dtim = apInfo.dtim_period;
+  }
+
+  switch (mode) {
+  case PS_OFF:
+    wwd_wifi_disable_powersave();
+    wakePeriod = 0;
+    return;
+
+  case PS_POLL:
+    wwd_wifi_enable_powersave();
+    break;
+
+  case PS_FAST:
+    wwd_wifi_enable_powersave_with_throughput(FAST_SLEEP_DELAY);
+    break;
+  }
+
+  wwd_wifi_set_listen_interval(listenInterval, WICED_LISTEN_INTERVAL_TIME_UNIT_DTIM);
+
+/*
+ * Beacon period is in time units of 1024 us.
+ */
+  wakePeriod = MS((uint32_t)listenInterval * dtim * beacon * 1024 / 1000);
+  printf("Wifi power save %s, radio wakes every %lu ms.\n",
+         modeNames[mode],
+         (unsigned long)(wakePeriod * 1000 / HZ));
+}
+
+/*
+ * Receive timeout for mqtt. It is a multiple of radio
+ * wake period, so that task wakes up when radio is
+ * awake anyway. Zero means no power save.
+ */
+JIF_t wifiReceiveTimeout()
+{
+  JIF_t timeout;
+
+  if (wakePeriod == 0)
+    return 0;
+
+  timeout = wakePeriod;
+  while (timeout < MS(1000))
+    timeout += wakePeriod;
+
+  return timeout;
+}
+
+void wifiLatency(JIF_t latency)
+{
+  if (probes == 0 || latency < latencyMin)
+    latencyMin = latency;
+
+  if (latency > latencyMax)
+    latencyMax = latency;
+
+  latencySum += latency;
+  ++probes;
+}
+
+static int ps(EshContext* ctx)
+{
+  char* modeArg = eshNamedArg(ctx, "mode", true);
+  char* listenArg = eshNamedArg(ctx, "listen", true);
+  char* probeArg = eshNamedArg(ctx, "probe", true);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (modeArg != NULL || listenArg != NULL) {
+
+    if (modeArg != NULL)
+      uosConfigSet("wifi.ps", modeArg);
+
+    if (listenArg != NULL)
+      uosConfigSet("wifi.listen", listenArg);
+
+    powerSaveConfig();
+    connPowerSave();
+    latencyClear();
+  }
+
+  if (probeArg != NULL)
+    uosConfigSet("mqtt.probe", probeArg);
+
+  eshPrintf(ctx, "Power save %s, listen interval %d DTIM, wake period %lu ms.\n",
+            modeNames[mode],
+            listenInterval,
+            (unsigned long)(wakePeriod * 1000 / HZ));
+
+  if (probes > 0)
+    eshPrintf(ctx, "%lu mqtt round trips, min %lu avg %lu max %lu ms.\n",
+              (unsigned long)probes,
+              (unsigned long)(latencyMin * 1000 / HZ),
+              (unsigned long)(latencySum * 1000 / HZ / probes),
+              (unsigned long)(latencyMax * 1000 / HZ));
+
+  return 0;
+}
+
+const EshCommand psCommand = {
+  .flags = 0,
+  .name = "ps",
+  .help = "--mode off|ps|fast --listen dtims --probe 0|1\nconfigure wifi power save and mqtt latency probe",
+  .handler = ps
+};
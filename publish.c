@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Report-by-exception publish policy. A value is published
+ * when it moves outside deadband around last published
+ * value (but not more often than minimum interval) or
+ * when heartbeat interval expires.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "emw-meter.h"
+
+/*
+ * Load policy from config entry pub.<name>, which
+ * has format abs,rel,min,max. Abs is absolute deadband,
+ * rel is relative deadband in percent, min and max
+ * are minimum and heartbeat intervals in seconds.
+ * Missing fields keep their defaults.
+ */
+void pubPolicyLoad(PubPolicy* p)
+{
+  char key[24];
+  const char* cfg;
+  char* end;
+  float v[4];
+  int i;
+
+  v[0] = p->absBand;
+  v[1] = p->relBand * 100;
+  v[2] = p->minInterval;
+  v[3] = p->maxInterval;
+
+  snprintf(key, sizeof(key), "pub.%s", p->name);
+  cfg = uosConfigGet(key);
+
+  for (i = 0; cfg != NULL && *cfg && i < 4; i++) {
+
+    if (*cfg != ',') {
+
+      v[i] = strtof(cfg, &end);
+      if (end == cfg)
+        break;
+
+      cfg = end;
+    }
+
+    if (*cfg == ',')
+      ++cfg;
+  }
+
+  p->absBand = v[0];
+  p->relBand = v[1] / 100;
+  p->minInterval = v[2];
+  p->maxInterval = v[3];
+}
+
+/*
+ * Check if value should be published now. Fresh
+ * is true when value has been updated since last check,
+ * only fresh values that are not published are
+ * counted as suppressed. Value that moves outside deadband
+ * before minimum interval has passed is left pending and
+ * checked again on following calls, even if it is not
+ * updated anymore.
+ */
+bool pubPolicyCheck(PubPolicy* p, float value, bool fresh)
+{
+  JIF_t elapsed;
+  float delta;
+  bool outside;
+
+  if (IS_MISSING(value))
+    return false;
+
+  if (!p->published)
+    return true;
+
+  elapsed = jiffies - p->lastTime;
+  if (p->maxInterval > 0 && elapsed >= MS(p->maxInterval * 1000))
+    return true;
+
+  if (!fresh && !p->pending)
+    return false;
+
+  delta = fabsf(value - p->lastValue);
+  if (p->absBand <= 0 && p->relBand <= 0)
+    outside = delta > 0;
+  else
+    outside = (p->absBand > 0 && delta >= p->absBand) ||
+              (p->relBand > 0 && delta >= p->relBand * fabsf(p->lastValue));
+
+  p->pending = outside;
+  if (outside && elapsed >= MS(p->minInterval * 1000))
+    return true;
+
+  if (fresh && !outside)
+    ++p->suppressed;
+
+  return false;
+}
+
+void pubPolicySent(PubPolicy* p, float value)
+{
+  p->published = true;
+  p->pending = false;
+  p->lastValue = value;
+  p->lastTime = jiffies;
+  ++p->sent;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Energy meter pulse counter (S0 or LED output) on PB8.
+ * Interrupt handler only timestamps and counts pulses,
+ * a scheduler job turns them into power. Power comes
+ * from interval between last two pulses, when pulses stop
+ * coming time since last pulse is used as upper limit.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+#define PULSE_INTERVAL   5000
+#define PULSE_TOLERANCE  2000
+#define SAMPLE_INTERVAL  300000
+#define DEFAULT_DEBOUNCE 20
+
+static volatile uint32_t pulses;
+static volatile JIF_t lastPulse;
+static volatile JIF_t pulseInterval;
+static volatile uint32_t bounces;
+
+static JIF_t debounce = MS(DEFAULT_DEBOUNCE);
+static int rate;
+static JIF_t lastSample;
+static bool counting;
+
+void EXTI9_5_irq()
+{
+  JIF_t now;
+
+  c_pos_intEnter();
+
+  if (EXTI_GetITStatus(EXTI_Line8) != RESET) {
+
+    EXTI_ClearITPendingBit(EXTI_Line8);
+    now = jiffies;
+    if (pulses > 0 && now - lastPulse < debounce)
+      ++bounces;
+    else {
+
+      if (pulses > 0)
+        pulseInterval = now - lastPulse;
+
+      lastPulse = now;
+      ++pulses;
+    }
+  }
+
+  c_pos_intExit();
+}
+
+/*
+ * Take consistent copy of values updated by interrupt handler.
+ */
+static void pulseSnapshot(uint32_t* count, JIF_t* last, JIF_t* interval)
+{
+  POS_LOCKFLAGS;
+
+  POS_SCHED_LOCK;
+  *count = pulses;
+  *last = lastPulse;
+  *interval = pulseInterval;
+  POS_SCHED_UNLOCK;
+}
+
+/*
+ * Power in watts from time between pulses.
+ */
+static float pulsePower(JIF_t interval)
+{
+  return 3600.0 * 1000 * HZ / ((float)rate * interval);
+}
+
+static void pulseJobRun(SchedJob* job)
+{
+  uint32_t count;
+  JIF_t last;
+  JIF_t interval;
+  JIF_t now;
+
+  pulseSnapshot(&count, &last, &interval);
+  now = jiffies;
+
+  if (count < 2)
+    channelSet(&powerChannel, MISSING_VALUE);
+  else {
+
+    if (now - last > interval)
+      interval = now - last;
+
+    channelSet(&powerChannel, pulsePower(interval));
+  }
+
+  if (now - lastSample >= MS(SAMPLE_INTERVAL)) {
+
+    channelSample(&powerChannel);
+    lastSample = now;
+  }
+}
+
+static SchedJob pulseJob = {
+  .name = "pulse",
+  .run = pulseJobRun,
+  .period = MS(PULSE_INTERVAL),
+  .tolerance = MS(PULSE_TOLERANCE)
+};
+
+static void pulseConfig()
+{
+  const char* cfg;
+
+  cfg = uosConfigGet("pulse.rate");
+  rate = cfg ? atoi(cfg) : 0;
+
+  cfg = uosConfigGet("pulse.debounce");
+  debounce = MS(cfg ? atoi(cfg) : DEFAULT_DEBOUNCE);
+}
+
+/*
+ * Start pulse counting, if meter pulse rate
+ * (impulses per kWh) is configured.
+ */
+void pulseStart()
+{
+  GPIO_InitTypeDef GPIO_InitStructure;
+  EXTI_InitTypeDef EXTI_InitStructure;
+
+  pulseConfig();
+  if (rate <= 0)
+    return;
+
+  RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+
+  GPIO_InitStructure.GPIO_Pin = GPIO_Pin_8;
+  GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN;
+  GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+  GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
+  GPIO_Init(GPIOB, &GPIO_InitStructure);
+
+  SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOB, EXTI_PinSource8);
+
+  EXTI_InitStructure.EXTI_Line = EXTI_Line8;
+  EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+  EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Falling;
+  EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+  EXTI_Init(&EXTI_InitStructure);
+
+  NVIC_SetPriority(EXTI9_5_IRQn, PORTCFG_API_MAX_PRI);
+  NVIC_EnableIRQ(EXTI9_5_IRQn);
+
+  lastSample = jiffies;
+  counting = true;
+  schedAdd(&pulseJob, 0);
+}
+
+/*
+ * True if power channel is fed by pulse counter,
+ * so that it must not be taken from mqtt.
+ */
+bool pulseActive()
+{
+  return counting;
+}
+
+static int pulse(EshContext* ctx)
+{
+  char* rateArg = eshNamedArg(ctx, "rate", true);
+  char* debounceArg = eshNamedArg(ctx, "debounce", true);
+  uint32_t count;
+  JIF_t last;
+  JIF_t interval;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (rateArg != NULL)
+    uosConfigSet("pulse.rate", rateArg);
+
+  if (debounceArg != NULL) {
+
+    uosConfigSet("pulse.debounce", debounceArg);
+    debounce = MS(atoi(debounceArg));
+  }
+
+  if (rate <= 0) {
+
+    eshPrintf(ctx, "Pulse counter not enabled.\n");
+    return 0;
+  }
+
+  pulseSnapshot(&count, &last, &interval);
+  eshPrintf(ctx, "%lu pulses (%.3f kWh), %lu bounces, last interval %lu ms.\n",
+            (unsigned long)count,
+            count / (float)rate,
+            (unsigned long)bounces,
+            (unsigned long)(interval * 1000 / HZ));
+
+  if (count >= 2)
+    eshPrintf(ctx, "Power %.0f W.\n", pulsePower(interval));
+
+  return 0;
+}
+
+const EshCommand pulseCommand = {
+  .flags = 0,
+  .name = "pulse",
+  .help = "--rate imp/kWh --debounce ms\nconfigure energy meter pulse counter (rate change needs restart)",
+  .handler = pulse
+};
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler for periodic work. Each job has a due time
+ * and a tolerance, it may be delayed until due + tolerance.
+ * Scheduler sleeps until first such deadline and then runs
+ * all jobs that are due, so jobs with overlapping windows
+ * share a single wakeup.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+static POSMUTEX_t schedMutex;
+static POSSEMA_t schedSema;
+static SchedJob* jobs;
+
+static JIF_t started;
+static JIF_t sleepTime;
+static uint32_t wakeups;
+
+void schedInit()
+{
+  schedMutex = posMutexCreate();
+  schedSema = posSemaCreate(0);
+  started = jiffies;
+}
+
+/*
+ * Start job, first run happens after given delay.
+ * If job is already running, its due time is changed.
+ */
+void schedAdd(SchedJob* job, JIF_t delay)
+{
+  posMutexLock(schedMutex);
+
+  job->due = jiffies + delay;
+  job->active = true;
+  if (!job->linked) {
+
+    job->next = jobs;
+    jobs = job;
+    job->linked = true;
+  }
+
+  posMutexUnlock(schedMutex);
+  posSemaSignal(schedSema);
+}
+
+void schedStop(SchedJob* job)
+{
+  posMutexLock(schedMutex);
+  job->active = false;
+  posMutexUnlock(schedMutex);
+}
+
+/*
+ * Find next job that is due. Its next due
+ * time is updated before returning it.
+ */
+static SchedJob* nextDue(JIF_t now)
+{
+  SchedJob* job;
+
+  for (job = jobs; job != NULL; job = job->next) {
+
+    if (!job->active || (int32_t)(now - job->due) < 0)
+      continue;
+
+    if ((int32_t)(job->due + job->tolerance - now) > 0)
+      ++job->coalesced;
+
+    ++job->runs;
+    if (job->period == 0)
+      job->active = false;
+    else {
+
+      job->due += job->period;
+      if ((int32_t)(now - job->due) >= 0)
+        job->due = now + job->period;
+    }
+
+    return job;
+  }
+
+  return NULL;
+}
+
+/*
+ * Time to sleep until first deadline.
+ */
+static int32_t nextWait(JIF_t now)
+{
+  SchedJob* job;
+  int32_t wait = -1;
+  int32_t w;
+
+  for (job = jobs; job != NULL; job = job->next) {
+
+    if (!job->active)
+      continue;
+
+    w = (int32_t)(job->due + job->tolerance - now);
+    if (w < 0)
+      w = 0;
+
+    if (wait == -1 || w < wait)
+      wait = w;
+  }
+
+  return wait;
+}
+
+static void schedTask(void* arg)
+{
+  SchedJob* job;
+  int32_t wait;
+  JIF_t now;
+
+  while (true) {
+
+    posMutexLock(schedMutex);
+    wait = nextWait(jiffies);
+    posMutexUnlock(schedMutex);
+
+    if (wait != 0) {
+
+      now = jiffies;
+      if (wait == -1)
+        posSemaGet(schedSema);
+      else
+        posSemaWait(schedSema, wait);
+
+      sleepTime += jiffies - now;
+    }
+
+    now = jiffies;
+    posMutexLock(schedMutex);
+    job = nextDue(now);
+    if (job != NULL)
+      ++wakeups;
+
+    while (job != NULL) {
+
+      posMutexUnlock(schedMutex);
+      job->run(job);
+      posMutexLock(schedMutex);
+      job = nextDue(now);
+    }
+
+    posMutexUnlock(schedMutex);
+  }
+}
+
+void schedStart()
+{
+  nosTaskCreate(schedTask, NULL, 2, 3000, "Sched");
+}
+
+static int sched(EshContext* ctx)
+{
+  SchedJob* job;
+  JIF_t uptime;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  uptime = jiffies - started;
+  if (uptime == 0)
+    uptime = 1;
+
+  eshPrintf(ctx, "job             period   tol    runs coalesced\n");
+  posMutexLock(schedMutex);
+  for (job = jobs; job != NULL; job = job->next)
+    eshPrintf(ctx, "%-14s %7lu %5lu %7lu %9lu\n",
+              job->name,
+              (unsigned long)(job->period * 1000 / HZ),
+              (unsigned long)(job->tolerance * 1000 / HZ),
+              (unsigned long)job->runs,
+              (unsigned long)job->coalesced);
+
+  posMutexUnlock(schedMutex);
+
+  eshPrintf(ctx, "%lu wakeups, %lu per hour, sleeping %lu%% of time.\n",
+            (unsigned long)wakeups,
+            (unsigned long)((uint64_t)wakeups * 3600 * HZ / uptime),
+            (unsigned long)((uint64_t)sleepTime * 100 / uptime));
+  return 0;
+}
+
+const EshCommand schedCommand = {
+  .flags = 0,
+  .name = "sched",
+  .help = "show scheduler statistics",
+  .handler = sched
+};
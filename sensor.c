@@ -31,29 +31,88 @@
 #include <picoos.h>
 #include <picoos-u.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
+#include <eshell.h>
 #include "devtree.h"
 #include "emw-meter.h"
 
 #include <picoos-ow.h>
-#include <temp10.h>
+#include <owcfg.h>
 
-static void sensorAddressStr(char* buf, uint8_t* serialNum)
-{
-  int i;
+/*
+ * DS18x20 commands and family codes.
+ */
+#define CMD_SKIP_ROM         0xcc
+#define CMD_CONVERT_T        0x44
+#define CMD_READ_SCRATCHPAD  0xbe
+#define CMD_WRITE_SCRATCHPAD 0x4e
+#define CMD_COPY_SCRATCHPAD  0x48
 
-  *buf = '\0';
-  for (i = 7; i >= 0; i--) {
+#define FAMILY_DS18S20       0x10
+#define FAMILY_DS18B20       0x28
 
-    sprintf(buf + strlen(buf), "%02X", (int)serialNum[i]);
-    if (i > 0)
-      strcat(buf, "-");
-   }
-}
+/*
+ * Temperature register at power-on (85 C).
+ */
+#define POWERON_DS18S20      0x00aa
+#define POWERON_DS18B20      0x0550
+
+#define CONVERSION_TIME      750
+#define EEPROM_WRITE_TIME    10
+
+#define READ_TRIES           3
+#define RETRY_DELAY          5
+#define MAX_STEP             5.0
+#define MAX_REJECTS          3
+#define SENSOR_INTERVAL      15000
+#define SENSOR_TOLERANCE     3000
+
+#define MAX_SENSORS          4
+
+/*
+ * DS18x20 devices found on bus. Each of them
+ * updates a channel, which is looked up by name
+ * from config entry ow.<rom>. Table is only accessed
+ * while bus is acquired.
+ */
+typedef struct {
+
+  uint8_t  rom[8];
+  char     name[20];
+  uint8_t  bits;
+  Channel  channel;
+  Channel* ch;
+  float    lastValue;
+  int      rejectRun;
+  uint32_t reads;
+  uint32_t presenceErrors;
+  uint32_t crcErrors;
+  uint32_t retries;
+  uint32_t rejects;
+} Sensor;
+
+static Sensor sensorTable[MAX_SENSORS];
+static int sensorCount;
+static int conversionTime = CONVERSION_TIME;
+
+/*
+ * DS18B20 conversion time for 9, 10, 11 and 12 bit
+ * resolution (datasheet maximums).
+ */
+static const uint16_t conversionTimes[] = { 94, 188, 375, 750 };
+static bool romScanNeeded = true;
 
 void init1Wire()
 {
+#if OWCFG_USART
+
+  owUartInit();
+
+#else
+
   GPIO_InitTypeDef GPIO_InitStructure;
 
   RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB, ENABLE);
@@ -66,6 +125,9 @@ void init1Wire()
   GPIO_Init(GPIOB, &GPIO_InitStructure);
 
   GPIO_ResetBits(GPIOB, GPIO_Pin_10);
+
+#endif
+
   owInit();
 
   if (!owAcquire(0, NULL)) {
@@ -78,29 +140,430 @@ void init1Wire()
   printf("OneWire OK.\n");
 }
 
-float read1Wire()
+static void romString(const uint8_t* rom, char* buf)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, buf += 2)
+    sprintf(buf, "%02X", rom[i]);
+}
+
+/*
+ * Map sensor to channel. Name is taken from config,
+ * first sensor defaults to inside. If there is no channel
+ * with that name yet, sensor gets its own.
+ */
+static void mapSensor(Sensor* s, int index)
+{
+  char key[20];
+  const char* name;
+  Channel* ch;
+
+  strcpy(key, "ow.");
+  romString(s->rom, key + 3);
+  name = uosConfigGet(key);
+  if (name == NULL || *name == '\0')
+    name = index == 0 ? insideChannel.name : key + 3;
+
+  ch = channelFind(name);
+  if (ch == NULL) {
+
+/*
+ * Channel of this table slot may already be registered
+ * under name of a previous sensor, so it is renamed
+ * (and its history dropped) under channel lock.
+ */
+    channelLock();
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->channel.name = s->name;
+    s->channel.scale = 10;
+    channelClear(&s->channel);
+    channelUnlock();
+
+    ch = &s->channel;
+    if (!channelRegister(ch))
+      printf("OneWire: too many channels\n");
+  }
+
+  s->ch = ch;
+}
+
+/*
+ * Reset bus and address device. If it is the only
+ * one on bus, there is no need to send the ROM code.
+ */
+static bool selectDevice(Sensor* s)
+{
+  if (sensorCount == 1)
+    return owTouchReset(0) && owWriteByte(0, CMD_SKIP_ROM);
+
+  owSerialNum(0, s->rom, FALSE);
+  return owAccess(0);
+}
+
+/*
+ * Read scratchpad of sensor. Failed reads are retried
+ * after a short delay, if all of them fail bus is
+ * enumerated again before next conversion.
+ */
+static bool readScratchpad(Sensor* s, uint8_t* scratch)
+{
+  int i;
+  int tries;
+
+  for (tries = 0; tries < READ_TRIES; tries++) {
+
+    if (tries > 0) {
+
+      ++s->retries;
+      posTaskSleep(MS(RETRY_DELAY << tries));
+    }
+
+    if (!selectDevice(s) || !owWriteByte(0, CMD_READ_SCRATCHPAD)) {
+
+      ++s->presenceErrors;
+      continue;
+    }
+
+    setcrc8(0, 0);
+    for (i = 0; i < 9; i++) {
+
+      scratch[i] = owReadByte(0);
+      docrc8(0, scratch[i]);
+    }
+
+    if (docrc8(0, 0) == 0)
+      return true;
+
+    ++s->crcErrors;
+  }
+
+  romScanNeeded = true;
+  return false;
+}
+
+/*
+ * Reject values that differ too much from previous one,
+ * unless they are repeated (then it is a real change).
+ */
+static bool plausible(Sensor* s, float value)
+{
+  if (!IS_MISSING(s->lastValue) &&
+      fabsf(value - s->lastValue) > MAX_STEP &&
+      s->rejectRun < MAX_REJECTS) {
+
+    ++s->rejectRun;
+    ++s->rejects;
+    return false;
+  }
+
+  s->rejectRun = 0;
+  s->lastValue = value;
+  return true;
+}
+
+/*
+ * Read sensor after conversion has completed
+ * and convert result to temperature.
+ */
+static float readTemperature(Sensor* s)
+{
+  uint8_t scratch[9];
+  float value = MISSING_VALUE;
+
+  ++s->reads;
+  if (!readScratchpad(s, scratch))
+    return value;
+
+  int16_t raw = (scratch[1] << 8) | scratch[0];
+
+  // Power-on value 85 C, conversion didn't happen.
+  if (raw == (s->rom[0] == FAMILY_DS18S20 ? POWERON_DS18S20 : POWERON_DS18B20)) {
+
+    ++s->rejects;
+    return value;
+  }
+
+  if (s->rom[0] == FAMILY_DS18S20) {
+
+    if (scratch[7] == 0)
+      return value;
+
+    value = (raw >> 1) - 0.25 + (scratch[7] - scratch[6]) / (float)scratch[7];
+  }
+  else {
+
+    // Low bits are undefined with less than 12 bit resolution.
+    raw &= ~((1 << (12 - s->bits)) - 1);
+    value = raw / 16.0;
+  }
+
+  if (!plausible(s, value))
+    return MISSING_VALUE;
+
+  return value;
+}
+
+/*
+ * Set DS18B20 resolution from config entry owbits.<rom>.
+ * Configuration register is copied to sensor EEPROM, but only
+ * if it differs from current setting. Without config entry
+ * sensor resolution is left as it is.
+ */
+static void setResolution(Sensor* s)
+{
+  char key[24];
+  const char* cfg;
+  uint8_t scratch[9];
+  int bits;
+
+  s->bits = 12;
+  if (s->rom[0] != FAMILY_DS18B20 || !readScratchpad(s, scratch))
+    return;
+
+  s->bits = ((scratch[4] >> 5) & 3) + 9;
+
+  strcpy(key, "owbits.");
+  romString(s->rom, key + 7);
+  cfg = uosConfigGet(key);
+  if (cfg == NULL)
+    return;
+
+  bits = atoi(cfg);
+  if (bits < 9 || bits > 12 || bits == s->bits)
+    return;
+
+  if (!selectDevice(s) ||
+      !owWriteByte(0, CMD_WRITE_SCRATCHPAD) ||
+      !owWriteByte(0, scratch[2]) ||
+      !owWriteByte(0, scratch[3]) ||
+      !owWriteByte(0, ((bits - 9) << 5) | 0x1f))
+    return;
+
+  if (selectDevice(s) && owWriteBytePower(0, CMD_COPY_SCRATCHPAD))
+    posTaskSleep(MS(EEPROM_WRITE_TIME));
+
+  owLevel(0, MODE_NORMAL);
+  s->bits = bits;
+}
+
+/*
+ * Enumerate DS18x20 devices on bus into sensor table.
+ * Bus must be acquired.
+ */
+static void scanBus()
+{
+  bool found;
+  int i;
+  Sensor* s;
+  uint8_t rom[8];
+
+  sensorCount = 0;
+  found = owFirst(0, TRUE, FALSE);
+  while (found && sensorCount < MAX_SENSORS) {
+
+    s = sensorTable + sensorCount;
+    owSerialNum(0, rom, TRUE);
+    if (rom[0] == FAMILY_DS18S20 || rom[0] == FAMILY_DS18B20) {
+
+      if (memcmp(s->rom, rom, sizeof(rom))) {
+
+        memcpy(s->rom, rom, sizeof(rom));
+        s->lastValue = MISSING_VALUE;
+        s->rejectRun = 0;
+        s->reads = 0;
+        s->presenceErrors = 0;
+        s->crcErrors = 0;
+        s->retries = 0;
+        s->rejects = 0;
+      }
+
+      mapSensor(s, sensorCount);
+      ++sensorCount;
+    }
+
+    found = owNext(0, TRUE, FALSE);
+  }
+
+  romScanNeeded = false;
+
+/*
+ * Conversion of all sensors is started at once,
+ * so wait time is decided by the slowest one.
+ */
+  conversionTime = 0;
+  for (i = 0, s = sensorTable; i < sensorCount; i++, s++) {
+
+    setResolution(s);
+    if (s->rom[0] == FAMILY_DS18S20)
+      conversionTime = CONVERSION_TIME;
+    else if (conversionTimes[s->bits - 9] > conversionTime)
+      conversionTime = conversionTimes[s->bits - 9];
+  }
+}
+
+/*
+ * Start temperature conversion on all sensors at once.
+ * Bus is left at strong pullup for parasite powered
+ * devices and released so that conversion time can be slept.
+ */
+static bool startConversion()
 {
-  int	  result;
-  uint8_t serialNum[8];
-  char buf[40];
-  float value = -273;
+  bool ok = false;
 
   if (!owAcquire(0, NULL)) {
 
     printf("OneWire: owAcquire failed\n");
-    return value;
+    return false;
   }
 
-  result = owFirst(0, TRUE, FALSE);
+  if (romScanNeeded)
+    scanBus();
 
-  if (result) {
+  if (sensorCount > 0 &&
+      owTouchReset(0) &&
+      owWriteByte(0, CMD_SKIP_ROM) &&
+      owWriteBytePower(0, CMD_CONVERT_T))
+    ok = true;
+  else
+    romScanNeeded = true;
 
-    owSerialNum(0, serialNum, TRUE);
-    sensorAddressStr(buf, serialNum);
-    if (!ReadTemperature(0, serialNum, &value) || value >= 85.0)
-      value = MISSING_VALUE;
+  owRelease(0);
+  return ok;
+}
+
+/*
+ * Read results of all sensors into their channels.
+ * If value is MISSING_VALUE, don't bother talking
+ * to sensors, just mark channels missing.
+ */
+static void readSensors(float value)
+{
+  int i;
+  Sensor* s;
+
+  if (!owAcquire(0, NULL)) {
+
+    printf("OneWire: owAcquire failed\n");
+    return;
   }
 
+  TRACE_BEGIN(TRACE_ONEWIRE);
+  owLevel(0, MODE_NORMAL);
+  for (i = 0, s = sensorTable; i < sensorCount; i++, s++)
+    channelSet(s->ch, IS_MISSING(value) ? value : readTemperature(s));
+
+  TRACE_END(TRACE_ONEWIRE);
   owRelease(0);
-  return value;
 }
+
+static void readJobRun(SchedJob* job)
+{
+  readSensors(0);
+}
+
+static SchedJob readJob = {
+  .name = "1-wire read",
+  .run = readJobRun,
+  .period = 0,
+  .tolerance = MS(100)
+};
+
+/*
+ * Start conversion and schedule reading of results
+ * after it has completed. Gui only uses values from
+ * channels, so it is never blocked by 1-wire bus.
+ */
+static void convertJobRun(SchedJob* job)
+{
+  if (startConversion())
+    schedAdd(&readJob, MS(conversionTime));
+  else
+    readSensors(MISSING_VALUE);
+}
+
+static SchedJob convertJob = {
+  .name = "1-wire",
+  .run = convertJobRun,
+  .period = MS(SENSOR_INTERVAL),
+  .tolerance = MS(SENSOR_TOLERANCE)
+};
+
+void sensorStart()
+{
+  schedAdd(&convertJob, 0);
+}
+
+static int sensors(EshContext* ctx)
+{
+  int i;
+  Sensor* s;
+  char rom[17];
+  char key[24];
+  float value;
+  char* bits = eshNamedArg(ctx, "bits", true);
+  char* romArg = eshNextArg(ctx, true);
+  char* name = eshNextArg(ctx, true);
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (!owAcquire(0, NULL)) {
+
+    eshPrintf(ctx, "owAcquire failed.\n");
+    return -1;
+  }
+
+  if (romArg != NULL) {
+
+    if ((name == NULL && bits == NULL) || strlen(romArg) != 16) {
+
+      owRelease(0);
+      eshPrintf(ctx, "Usage: sensors [--bits 9-12] [rom [channel]]\n");
+      return -1;
+    }
+
+    if (name != NULL) {
+
+      snprintf(key, sizeof(key), "ow.%s", romArg);
+      uosConfigSet(key, name);
+    }
+
+    if (bits != NULL) {
+
+      snprintf(key, sizeof(key), "owbits.%s", romArg);
+      uosConfigSet(key, bits);
+    }
+  }
+
+  scanBus();
+  for (i = 0, s = sensorTable; i < sensorCount; i++, s++) {
+
+    romString(s->rom, rom);
+    value = channelGet(s->ch);
+    if (IS_MISSING(value))
+      eshPrintf(ctx, "%s %-10s %2d bits --.-\n", rom, s->ch->name, s->bits);
+    else
+      eshPrintf(ctx, "%s %-10s %2d bits %4.1f\n", rom, s->ch->name, s->bits, value);
+
+    eshPrintf(ctx, "  reads %lu presence errors %lu crc errors %lu retries %lu rejected %lu\n",
+              (unsigned long)s->reads,
+              (unsigned long)s->presenceErrors,
+              (unsigned long)s->crcErrors,
+              (unsigned long)s->retries,
+              (unsigned long)s->rejects);
+  }
+
+  eshPrintf(ctx, "%d sensors, conversion time %d ms.\n", sensorCount, conversionTime);
+  owRelease(0);
+  return 0;
+}
+
+const EshCommand sensorsCommand = {
+  .flags = 0,
+  .name = "sensors",
+  .help = "[--bits 9-12] [rom [channel]]\nenumerate 1-wire temperature sensors or set channel and resolution of sensor",
+  .handler = sensors
+};
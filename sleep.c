@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sleep accounting. Idle task hook runs each time before
+ * cpu goes to sleep. Time between two hook calls minus
+ * time counted by DWT cycle counter (which stops during
+ * sleep) is time slept. Interrupts that can wake cpu are
+ * routed through wrappers in vector table, first one
+ * after sleep is recorded as wakeup source.
+ *
+ * Time in STOP mode is measured with free running TIM2,
+ * which (like all APB timers) stops in STOP mode but keeps
+ * running in normal sleep. Wall clock time not counted
+ * by TIM2 was spent in STOP mode.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+#define SLEEP_INTERVAL  60000
+#define SLEEP_TOLERANCE 30000
+
+Channel sleepChannel = { .name = "sleep", .scale = 1 };
+
+static const char* const sourceNames[WAKE_SOURCES] = {
+  [WAKE_RTC]   = "rtc",
+  [WAKE_WIFI]  = "wifi",
+  [WAKE_UART]  = "uart",
+  [WAKE_TIMER] = "timer",
+  [WAKE_PULSE] = "pulse",
+  [WAKE_OTHER] = "other"
+};
+
+static SleepStats stats;
+static JIF_t lastJiffies;
+static uint32_t lastCycles;
+static uint32_t lastClocked;
+static uint32_t cyclesPerUs;
+static volatile bool sleeping;
+static volatile uint8_t wakeSource;
+
+/*
+ * Called by interrupt wrappers.
+ */
+static inline void sleepWake(int source)
+{
+  if (sleeping) {
+
+    sleeping = false;
+    wakeSource = source;
+  }
+}
+
+#define WAKE_WRAPPER(name, handler, source) \
+void name(void)                             \
+{                                           \
+  sleepWake(source);                        \
+  handler();                                \
+}
+
+WAKE_WRAPPER(sleepRtcIrq,   RTC_WKUP_IRQHandler, WAKE_RTC)
+WAKE_WRAPPER(sleepSdioIrq,  SDIO_irq,            WAKE_WIFI)
+WAKE_WRAPPER(sleepUartIrq,  USART2_IRQHandler,   WAKE_UART)
+WAKE_WRAPPER(sleepTimerIrq, TIM5_irq,            WAKE_TIMER)
+WAKE_WRAPPER(sleepPulseIrq, EXTI9_5_irq,         WAKE_PULSE)
+
+static void idleHook(void)
+{
+  JIF_t now;
+  uint32_t cycles;
+  uint32_t wall;
+  uint32_t run;
+  uint32_t slept;
+  uint32_t clocked;
+  uint32_t stopped;
+  int source;
+  POS_LOCKFLAGS;
+
+  POS_SCHED_LOCK;
+  now = jiffies;
+  cycles = DWT->CYCCNT;
+  clocked = TIM2->CNT;
+
+  wall = (now - lastJiffies) * (1000000 / HZ);
+  run = (cycles - lastCycles) / cyclesPerUs;
+  slept = wall > run ? wall - run : 0;
+
+/*
+ * Differences smaller than one tick are jiffies
+ * granularity, not STOP mode.
+ */
+  stopped = wall - (clocked - lastClocked);
+  if ((int32_t)stopped <= 1000000 / HZ)
+    stopped = 0;
+  else if (stopped > slept)
+    stopped = slept;
+
+/*
+ * If no wrapped interrupt was seen, some other
+ * interrupt woke us.
+ */
+  if (lastJiffies != 0) {
+
+    stats.run += wall - slept;
+    source = sleeping ? WAKE_OTHER : wakeSource;
+    stats.deep += stopped;
+    stats.sleep += slept - stopped;
+
+    stats.slept[source] += slept;
+    ++stats.wakeups[source];
+  }
+
+  lastJiffies = now;
+  lastCycles = cycles;
+  lastClocked = clocked;
+  sleeping = true;
+  POS_SCHED_UNLOCK;
+}
+
+void sleepStats(SleepStats* st)
+{
+  POS_LOCKFLAGS;
+
+  POS_SCHED_LOCK;
+  *st = stats;
+  POS_SCHED_UNLOCK;
+}
+
+/*
+ * Update sleep percentage channel, which is
+ * published to mqtt.
+ */
+static void sleepJobRun(SchedJob* job)
+{
+  static SleepStats prev;
+  SleepStats st;
+  uint64_t run, slept;
+
+  sleepStats(&st);
+  run = st.run - prev.run;
+  slept = st.sleep + st.deep - prev.sleep - prev.deep;
+  prev = st;
+
+  if (run + slept > 0)
+    channelSet(&sleepChannel, 100.0 * slept / (run + slept));
+}
+
+static SchedJob sleepJob = {
+  .name = "sleep",
+  .run = sleepJobRun,
+  .period = MS(SLEEP_INTERVAL),
+  .tolerance = MS(SLEEP_TOLERANCE)
+};
+
+/*
+ * Start TIM2 as free running 1 MHz counter.
+ */
+static void stopTimerInit()
+{
+  TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+  RCC_ClocksTypeDef clocks;
+  uint32_t clk;
+
+  RCC_GetClocksFreq(&clocks);
+
+/*
+ * APB1 timers run at double PCLK1 when APB1 is prescaled.
+ */
+  clk = clocks.PCLK1_Frequency;
+  if (clk != clocks.HCLK_Frequency)
+    clk *= 2;
+
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+
+  TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+  TIM_TimeBaseStructure.TIM_Prescaler = clk / 1000000 - 1;
+  TIM_TimeBaseStructure.TIM_Period = 0xFFFFFFFF;
+  TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+  TIM_TimeBaseInit(TIM2, &TIM_TimeBaseStructure);
+  TIM_Cmd(TIM2, ENABLE);
+}
+
+void sleepInit()
+{
+  cyclesPerUs = SystemCoreClock / 1000000;
+  stopTimerInit();
+  channelRegister(&sleepChannel);
+  posInstallIdleTaskHook(idleHook);
+  schedAdd(&sleepJob, MS(SLEEP_INTERVAL));
+}
+
+static unsigned long ms(uint64_t us)
+{
+  return (unsigned long)(us / 1000);
+}
+
+static int sleepCmd(EshContext* ctx)
+{
+  char* clear = eshNamedArg(ctx, "clear", false);
+  SleepStats st;
+  uint64_t total;
+  int i;
+  POS_LOCKFLAGS;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (clear != NULL) {
+
+    POS_SCHED_LOCK;
+    memset(&stats, '\0', sizeof(stats));
+    POS_SCHED_UNLOCK;
+    return 0;
+  }
+
+  sleepStats(&st);
+  total = st.run + st.sleep + st.deep;
+  if (total == 0)
+    total = 1;
+
+  eshPrintf(ctx, "run   %10lu ms %5.1f%%\n", ms(st.run), 100.0 * st.run / total);
+  eshPrintf(ctx, "sleep %10lu ms %5.1f%%\n", ms(st.sleep), 100.0 * st.sleep / total);
+  eshPrintf(ctx, "stop  %10lu ms %5.1f%%\n", ms(st.deep), 100.0 * st.deep / total);
+
+  eshPrintf(ctx, "%-6s %8s %10s %8s\n", "wakeup", "count", "slept ms", "avg ms");
+  for (i = 0; i < WAKE_SOURCES; i++)
+    eshPrintf(ctx, "%-6s %8lu %10lu %8lu\n",
+              sourceNames[i],
+              (unsigned long)st.wakeups[i],
+              ms(st.slept[i]),
+              st.wakeups[i] ? ms(st.slept[i] / st.wakeups[i]) : 0UL);
+
+  return 0;
+}
+
+const EshCommand sleepCommand = {
+  .flags = 0,
+  .name = "sleep",
+  .help = "[--clear]\nshow time spent running and sleeping and what woke cpu up",
+  .handler = sleepCmd
+};
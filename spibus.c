@@ -35,6 +35,7 @@
 #include <string.h>
 #include <errno.h>
 
+#include <owcfg.h>
 #include "devtree.h"
 
 void spiInit(struct uosSpiBus* bus)
@@ -121,7 +122,9 @@ void spiInit(struct uosSpiBus* bus)
     /* SPI4 configuration */
     GPIO_PinAFConfig(GPIOB, GPIO_PinSource13, GPIO_AF6_SPI4); // CLK
     GPIO_PinAFConfig(GPIOA, GPIO_PinSource1, GPIO_AF_SPI4);   // MOSI
+#if !OWCFG_USART
     GPIO_PinAFConfig(GPIOA, GPIO_PinSource11, GPIO_AF6_SPI4); // MISO
+#endif
   
     GPIO_InitStructure.GPIO_Pin = GPIO_Pin_13;
     GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
@@ -130,7 +133,11 @@ void spiInit(struct uosSpiBus* bus)
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
     GPIO_Init(GPIOB, &GPIO_InitStructure);
  
+#if OWCFG_USART
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_1; // PA11 is used for 1-wire
+#else
     GPIO_InitStructure.GPIO_Pin = GPIO_Pin_1 | GPIO_Pin_11;
+#endif
     GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
     GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
     GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
@@ -56,6 +56,8 @@
 #define CMD_VCOMH_DESELECT_LVL       0xdb
 #define CMD_LOW_COLUMN               0x00
 #define CMD_HIGH_COLUMN              0x10
+#define CMD_COLUMN_ADDR              0x21
+#define CMD_PAGE_ADDR                0x22
 
 static UG_GUI gui;
 
@@ -93,6 +95,46 @@ CMD_CLOCK_SETUP,                   // set display clock divider & osc freq
     CMD_DISPLAY_ON_OFF | 0x1           // dispplay on
 };
 
+/*
+ * Settings that are rewritten before each screen update.
+ * If display controller has lost some of its state,
+ * this brings it back without full reset. Column and page
+ * windows also move write pointer to first pixel.
+ */
+static const uint8_t resync[] =
+{
+    CMD_CLOCK_SETUP,                   // set display clock divider & osc freq
+    0x80,                              //  100 frames / sec
+    CMD_MULTIPLEX_RATIO,               // set multiplex ratio
+    0x3f,                              //  1/64 duty
+    CMD_DISPLAY_OFFSET,                // set display offset
+    0x0,                               //  no offset
+    CMD_CHARGE_PUMP_SETTING,           // charge pump
+    0x14,                              //  turn on
+    CMD_PIN_HW_CONF,                   // com pins hw config
+    0x12,                              //
+    CMD_CONTRAST_CONTROL,              // set display contrast
+    0xcf,                              //
+    CMD_PRECHARGE_PERIOD,              // set pre charge period
+    0xf1,                              //
+    CMD_VCOMH_DESELECT_LVL,            // set Vcomh deselect level
+    0x30,                              //
+    CMD_MEM_ADDR_MODE,                 // set memory addressing
+    0x0,                               //  horizontal
+    CMD_COLUMN_ADDR,                   // column window
+    0,                                 //  start
+    127,                               //  end
+    CMD_PAGE_ADDR,                     // page window
+    0,                                 //  start
+    7,                                 //  end
+    CMD_DISPLAY_START_LINE | 0x0,      // set display start line
+    CMD_SEGMENT_REMAP | 0x1,           // segment remapping
+    CMD_OUTPUT_SCAN_DIR | 0x8,         // set scan direction
+    CMD_ENTIRE_DISPLAY_ON | 0x0,       // display follows ram
+    CMD_NORMAL_OR_INVERSE | 0x0,       // not inverse
+    CMD_DISPLAY_ON_OFF | 0x1           // display on
+};
+
 static void writeCmd(uint8_t cmd);
 static void writeData(uint8_t cmd);
 
@@ -115,16 +157,17 @@ static void drawPixel(UG_S16 x, UG_S16 y, UG_COLOR c)
 
 void guiUpdateScreen(void)
 {
+  TRACE_BEGIN(TRACE_FLUSH);
   UG_Update();
 
-  // Start at first pixel.
-  writeCmd(CMD_LOW_COLUMN | 0x0);
-  writeCmd(CMD_HIGH_COLUMN | 0x0);
-  writeCmd(CMD_DISPLAY_START_LINE | 0x0);
-
   int i;
+  for (i = 0; i < (int)sizeof(resync); i++)
+    writeCmd(resync[i]);
+
   for (i = 0; i < 1024; i++)
     writeData(buffer[i]);
+
+  TRACE_END(TRACE_FLUSH);
 }
 
 #define RST(x) GPIO_WriteBit(GPIOB, GPIO_Pin_1, x)
@@ -146,26 +189,30 @@ static void writeData(uint8_t cmd)
   uosSpiEnd(&oledDev);
 }
 
-void guiReset()
+/*
+ * Check that control pins are still configured
+ * as outputs and display is not held in reset.
+ * Controller itself cannot be read over spi.
+ */
+bool guiHealthy()
 {
-  C_D(Bit_RESET);
-  RST(Bit_SET);
-  posTaskSleep(MS(100));
-  RST(Bit_RESET);
+  if (GPIO_ReadOutputDataBit(GPIOB, GPIO_Pin_1) != Bit_SET)
+    return false;
 
-  posTaskSleep(MS(100));
-  RST(Bit_SET);
-  posTaskSleep(MS(100));
+  if (((GPIOB->MODER >> (1 * 2)) & 0x3) != GPIO_Mode_OUT)
+    return false;
 
-  const uint8_t* cmd;
-  unsigned int i;
+  if (((GPIOA->MODER >> (12 * 2)) & 0x3) != GPIO_Mode_OUT)
+    return false;
 
-  cmd = init;
-  for (i = 0; i < sizeof(init); i++, cmd++)
-    writeCmd(*cmd);
+  return true;
 }
 
-void guiInit()
+/*
+ * Configure C/D and RST pins. Done at every reset,
+ * in case something has changed them.
+ */
+static void initPins()
 {
   GPIO_InitTypeDef GPIO_InitStructure;
 
@@ -187,7 +234,91 @@ void guiInit()
   GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
   GPIO_InitStructure.GPIO_Speed = GPIO_Speed_100MHz;
   GPIO_Init(GPIOB, &GPIO_InitStructure);
+}
 
+static void sendInit()
+{
+  const uint8_t* cmd;
+  unsigned int i;
+
+  cmd = init;
+  for (i = 0; i < sizeof(init); i++, cmd++)
+    writeCmd(*cmd);
+}
+
+void guiReset()
+{
+  initPins();
+  C_D(Bit_RESET);
+  RST(Bit_SET);
+  posTaskSleep(MS(100));
+  RST(Bit_RESET);
+
+  posTaskSleep(MS(100));
+  RST(Bit_SET);
+  posTaskSleep(MS(100));
+
+  sendInit();
+}
+
+/*
+ * Full reset run by scheduler. Job is rescheduled for
+ * each step of RST pulse, so other jobs are not stalled
+ * while waiting.
+ */
+static int resetStep;
+static volatile bool resetting;
+
+static void resetJobRun(SchedJob* job)
+{
+  switch (resetStep++) {
+  case 0:
+    initPins();
+    C_D(Bit_RESET);
+    RST(Bit_SET);
+    break;
+
+  case 1:
+    RST(Bit_RESET);
+    break;
+
+  case 2:
+    RST(Bit_SET);
+    break;
+
+  default:
+    sendInit();
+    resetStep = 0;
+    resetting = false;
+    return;
+  }
+
+  schedAdd(job, MS(100));
+}
+
+static SchedJob resetJob = {
+  .name = "display reset",
+  .run = resetJobRun,
+  .period = 0,
+  .tolerance = 0
+};
+
+void guiResetStart()
+{
+  if (resetting)
+    return;
+
+  resetting = true;
+  schedAdd(&resetJob, 0);
+}
+
+bool guiResetting()
+{
+  return resetting;
+}
+
+void guiInit()
+{
   guiReset();
   UG_Init(&gui, drawPixel, 128, 64);
 
@@ -60,6 +60,8 @@
 #include "emw-meter.h"
 
 static bool alreadyJoined = false;
+static bool leaseCached;
+static JIF_t joinStarted;
 
 void initConfig()
 {
@@ -97,47 +99,145 @@ static int clear(EshContext* ctx)
   return 0;
 }
 
-void ifStatusCallback(struct netif *netif);
+/*
+ * Connection manager events.
+ */
+#define EV_CONFIG     0x01
+#define EV_RESET      0x02
+#define EV_LINK_DOWN  0x04
+#define EV_AP_START   0x10
+#define EV_AP_STOP    0x20
+#define EV_DHCP_BOUND 0x40
+#define EV_POWER_SAVE 0x80
+
+/*
+ * Connection manager states.
+ */
+enum {
+  C_IDLE,
+  C_JOIN,
+  C_WAIT_IP,
+  C_CONNECTED,
+  C_RETRY
+};
+
+static const char* const stateNames[] = {
+  "idle", "joining", "waiting for address", "connected", "waiting for retry"
+};
+
+#define RETRY_MIN 5000
+#define RETRY_MAX 120000
+#define DHCP_TIMEOUT 30000
+
+static POSSEMA_t connSema;
+static volatile uint32_t connEvents;
+static int connState = C_IDLE;
+
+/*
+ * Post event to connection manager. Can be called
+ * from any task, including lwip and wwd threads.
+ */
+static void connPost(uint32_t ev)
+{
+  POS_LOCKFLAGS;
+
+  POS_SCHED_LOCK;
+  connEvents |= ev;
+  POS_SCHED_UNLOCK;
+  posSemaSignal(connSema);
+}
+
+static uint32_t connWait(JIF_t timeout)
+{
+  uint32_t ev;
+  POS_LOCKFLAGS;
+
+  if (timeout == INFINITE)
+    posSemaGet(connSema);
+  else if (timeout > 0)
+    posSemaWait(connSema, timeout);
+
+  POS_SCHED_LOCK;
+  ev = connEvents;
+  connEvents = 0;
+  POS_SCHED_UNLOCK;
+  return ev;
+}
 
 /*
  * This is called by lwip when interface status changes.
+ * It runs in tcpip thread, so flash writes and wifi
+ * driver calls are left to connection manager. Station
+ * is considered connected only after DHCP has bound,
+ * cached address just lets mqtt start earlier.
  */
 void ifStatusCallback(struct netif *netif)
 {
   if (netif_is_up(netif)) {
 
-    /*
-     * Powersave experiments. Without these, about 73 mA is used.
-     * With wifi powersave, 15-20 mA is used.
-     */
-    //wwd_wifi_enable_powersave();
+    if (!leaseCached && dhcp_supplied_address(netif)) {
+
+      printf("DHCP bound in %lu ms.\n", (unsigned long)((jiffies - joinStarted) * 1000 / HZ));
+      leaseCached = true;
+      connPost(EV_DHCP_BOUND);
+    }
 
     potatoStart();
   }
 }
 
+/*
+ * Wifi link events from wwd.
+ */
+static const wwd_event_num_t linkEvents[] = {
+  WLC_E_LINK,
+  WLC_E_DEAUTH_IND,
+  WLC_E_DISASSOC_IND,
+  WLC_E_NONE
+};
+
+static void* linkEventHandler(const wwd_event_header_t* event, const uint8_t* data, void* arg)
+{
+  if (event->event_type == WLC_E_LINK && (event->flags & WLC_EVENT_MSG_LINK))
+    return arg;
+
+  connPost(EV_LINK_DOWN);
+  return arg;
+}
+
 struct netif defaultIf;
 
 static int staUp()
 {
   wiced_ssid_t ssid;
+  bool fast;
   /*
    * Get AP network name and password and attempt to join.
+   * Try first with cached AP details, which avoids scanning.
    */
 
   const char* ap = uosConfigGet("ap");
   const char* pass = uosConfigGet("pass");
 
-  strcpy((char*)ssid.value, ap);
-  ssid.length = strlen(ap);
+  joinStarted = jiffies;
+  fast = wifiCacheJoin(ap, pass);
+  if (!fast) {
 
-  if (wwd_wifi_join(&ssid, WICED_SECURITY_WPA2_MIXED_PSK, (uint8_t*)pass, strlen(pass), NULL, WWD_STA_INTERFACE) != WWD_SUCCESS)
-    return -1;
+    strcpy((char*)ssid.value, ap);
+    ssid.length = strlen(ap);
 
-  printf("Join OK.\n");
+    if (wwd_wifi_join(&ssid, WICED_SECURITY_WPA2_MIXED_PSK, (uint8_t*)pass, strlen(pass), NULL, WWD_STA_INTERFACE) != WWD_SUCCESS)
+      return -1;
+  }
+
+  printf("Join OK (%s) in %lu ms.\n", fast ? "cached" : "scan",
+         (unsigned long)((jiffies - joinStarted) * 1000 / HZ));
+
+  leaseCached = false;
+  if (wifiCachePreload(&defaultIf, ap))
+    printf("Using cached address until DHCP completes.\n");
 
   netifapi_netif_set_up(&defaultIf);
-  netif_set_status_callback(&defaultIf, ifStatusCallback);
   netifapi_dhcp_start(&defaultIf);
 
 #if LWIP_IPV6
@@ -154,11 +254,171 @@ static int staUp()
 
 static void staDown()
 {
+  if (!alreadyJoined)
+    return;
+
   wifiLed(false);
 
   netifapi_dhcp_stop(&defaultIf);
   netifapi_netif_set_down(&defaultIf);
   wwd_wifi_leave(WWD_STA_INTERFACE);
+  alreadyJoined = false;
+}
+
+static bool staConfigured()
+{
+  const char* ap = uosConfigGet("ap");
+  const char* pass = uosConfigGet("pass");
+
+  return ap && pass && ap[0] != '\0' && pass[0] != '\0';
+}
+
+/*
+ * Connection manager. This is the only task that brings
+ * station and access point interfaces up or down, others
+ * just post events to it. Failed joins are retried with
+ * increasing delay, access point is kept up while station
+ * is not connected so that device can be configured.
+ * If DHCP doesn't give an address in time, join is
+ * considered failed.
+ */
+static void connTask(void* arg)
+{
+  uint32_t ev;
+  JIF_t retryAt = 0;
+  JIF_t retryDelay = MS(RETRY_MIN);
+  JIF_t dhcpDeadline = 0;
+  JIF_t timeout;
+  bool failed;
+
+  connState = staConfigured() ? C_JOIN : C_IDLE;
+  if (connState == C_IDLE)
+    apUp();
+
+  while (true) {
+
+    if (connState == C_JOIN)
+      timeout = 0;
+    else if (connState == C_RETRY)
+      timeout = (int32_t)(retryAt - jiffies) > 0 ? retryAt - jiffies : 0;
+    else if (connState == C_WAIT_IP)
+      timeout = (int32_t)(dhcpDeadline - jiffies) > 0 ? dhcpDeadline - jiffies : 0;
+    else
+      timeout = INFINITE;
+
+    ev = connWait(timeout);
+
+    if ((ev & EV_AP_START) && !apIsActive())
+      apUp();
+
+    if ((ev & EV_AP_STOP) && apIsActive())
+      apDown();
+
+    if (ev & (EV_CONFIG | EV_RESET)) {
+
+      staDown();
+      retryDelay = MS(RETRY_MIN);
+      connState = (ev & EV_RESET) || !staConfigured() ? C_IDLE : C_JOIN;
+      if (connState == C_IDLE && !apIsActive())
+        apUp();
+    }
+
+    if ((ev & EV_LINK_DOWN) &&
+        (connState == C_WAIT_IP || connState == C_CONNECTED) &&
+        wwd_wifi_is_ready_to_transceive(WWD_STA_INTERFACE) != WWD_SUCCESS) {
+
+      printf("Wifi link lost.\n");
+      staDown();
+      connState = C_JOIN;
+    }
+
+    if ((ev & EV_DHCP_BOUND) && connState == C_WAIT_IP) {
+
+      wifiCacheUpdate(&defaultIf, uosConfigGet("ap"));
+
+      /*
+       * Without power save, about 73 mA is used.
+       * With wifi powersave, 15-20 mA is used.
+       */
+      wifiPowerSave();
+
+      connState = C_CONNECTED;
+      retryDelay = MS(RETRY_MIN);
+      if (apIsActive())
+        apDown();
+    }
+
+    if ((ev & EV_POWER_SAVE) && connState == C_CONNECTED)
+      wifiPowerSave();
+
+    failed = false;
+    if (connState == C_WAIT_IP && (int32_t)(jiffies - dhcpDeadline) >= 0) {
+
+      printf("No address from DHCP.\n");
+      staDown();
+      failed = true;
+    }
+
+    if (connState == C_RETRY && (int32_t)(jiffies - retryAt) >= 0)
+      connState = C_JOIN;
+
+    if (connState == C_JOIN) {
+
+      printf("Joining %s.\n", uosConfigGet("ap"));
+      if (staUp() == 0) {
+
+        connState = C_WAIT_IP;
+        dhcpDeadline = jiffies + MS(DHCP_TIMEOUT);
+      }
+      else {
+
+        printf("Join failed.\n");
+        failed = true;
+      }
+    }
+
+    if (failed) {
+
+      printf("Retrying in %lu s.\n", (unsigned long)(retryDelay / HZ));
+      if (!apIsActive())
+        apUp();
+
+      connState = C_RETRY;
+      retryAt = jiffies + retryDelay;
+      retryDelay *= 2;
+      if (retryDelay > MS(RETRY_MAX))
+        retryDelay = MS(RETRY_MAX);
+    }
+  }
+}
+
+/*
+ * Start connection manager, join happens in background.
+ */
+void connStart()
+{
+  connSema = posSemaCreate(0);
+  wwd_management_set_event_handler(linkEvents, linkEventHandler, NULL, WWD_STA_INTERFACE);
+  nosTaskCreate(connTask, NULL, 3, 1536, "Wifi");
+}
+
+void connApStart()
+{
+  connPost(EV_AP_START);
+}
+
+void connApStop()
+{
+  connPost(EV_AP_STOP);
+}
+
+/*
+ * Apply changed power save settings. If station is not
+ * connected, they are applied when DHCP binds.
+ */
+void connPowerSave()
+{
+  connPost(EV_POWER_SAVE);
 }
 
 /*
@@ -167,8 +427,8 @@ static void staDown()
 static int sta(EshContext* ctx)
 {
   char* reset = eshNamedArg(ctx, "reset", false);
-  char* ap;
-  char* pass;
+  char* ap = NULL;
+  char* pass = NULL;
 
   eshCheckNamedArgsUsed(ctx);
 
@@ -184,79 +444,34 @@ static int sta(EshContext* ctx)
 
   if (reset) {
 
-    if (alreadyJoined) {
-
-      staDown();
-      eshPrintf(ctx, "Left ap.\n");
-      alreadyJoined = false;
-    }
-
     uosConfigSet("ap", "");
     uosConfigSet("pass", "");
+    wifiCacheClear();
+    connPost(EV_RESET);
+    eshPrintf(ctx, "Leaving ap.\n");
     return 0;
   }
 
-  if (ap == NULL || pass == NULL) {
+  if (ap == NULL && pass == NULL) {
 
-    eshPrintf(ctx, "Usage: sta --reset | ap pass\n");
-    return -1;
+    eshPrintf(ctx, "Wifi %s.\n", stateNames[connState]);
+    return 0;
   }
 
-  if (alreadyJoined) {
+  if (ap == NULL || pass == NULL) {
 
-    eshPrintf(ctx, "Already joined Wifi network.\n");
+    eshPrintf(ctx, "Usage: sta [--reset | ap pass]\n");
     return -1;
   }
 
   uosConfigSet("ap", ap);
   uosConfigSet("pass", pass);
 
-  eshPrintf(ctx, "Joining %s with password %s\n", ap, pass);
-  if (staUp() == -1)
-    eshPrintf(ctx, "Join failed.\n");
-
+  eshPrintf(ctx, "Joining %s with password %s in background.\n", ap, pass);
+  connPost(EV_CONFIG);
   return 0;
 }
 
-static void joinThread(void* arg)
-{
-  const char* ap;
-  const char* pass;
-
-  do {
-    
-    ap = uosConfigGet("ap");
-    pass = uosConfigGet("pass");
-
-    posTaskSleep(MS(5000));
-
-  } while (ap &&
-           pass &&
-           !alreadyJoined &&
-           staUp() == -1);
-
-  printf("Background join exiting.\n");
-}
-
-void checkAP()
-{
-  const char* ap = uosConfigGet("ap");
-  const char* pass = uosConfigGet("pass");
-
-  if (ap[0] != '\0' && pass[0] != '\0') {
-
-    printf("Joining %s.\n", ap);
-    if (staUp() == -1) {
-
-       printf("Join failed, retrying join in background.\n");
-       apUp();
-       posTaskCreate(joinThread, NULL, 5, 1024);
-    }
-  }
-  else
-    apUp();
-}
-
 #if BUNDLE_FIRMWARE
 
 /*
@@ -271,46 +486,41 @@ static int copyfw(EshContext* ctx)
   if (eshArgError(ctx) != EshOK)
     return -1;
 
-  int from;
-  int to;
+  JIF_t start;
+  unsigned long ms;
+  uint32_t crc;
+  int len;
 
-  from = open("/firmware/" WDCFG_FIRMWARE, O_RDONLY);
-  if (from == -1) {
+/*
+ * Compressed firmware is expanded, raw one is copied.
+ */
+  switch (fwExpand(true)) {
+  case 1:
+    return 0;
 
-    eshPrintf(ctx, "Cannot open /firmware/" WDCFG_FIRMWARE ".\n");
+  case -1:
+    eshPrintf(ctx, "Cannot expand firmware.\n");
     return -1;
   }
 
-  to = open("/flash/" WDCFG_FIRMWARE, O_WRONLY | O_CREAT | O_TRUNC);
-  if (to == -1) {
+  start = jiffies;
+  len = fileCopy("/firmware/" WDCFG_FIRMWARE, "/flash/" WDCFG_FIRMWARE, &crc);
+  if (len < 0) {
 
-    eshPrintf(ctx, "Cannot open /flash/" WDCFG_FIRMWARE ".\n");
-    close(from);
+    eshPrintf(ctx, "Cannot copy /firmware/" WDCFG_FIRMWARE " to /flash.\n");
     return -1;
   }
 
-  int len;
-  char buf[128];
-
-  while ((len = read(from, buf, sizeof(buf))) > 0) {
-
-    if (write(to, buf, len) != len) {
-
-      eshPrintf(ctx, "Cannot write to /flash/" WDCFG_FIRMWARE ".\n");
-      break;
-    }
-  }
-
-  close(from);
-  close(to);
-
+  ms = (jiffies - start) * 1000 / HZ;
+  eshPrintf(ctx, "%d bytes in %lu ms (%lu KB/s), crc %08lx.\n", len, ms,
+            ms ? (unsigned long)len / ms : 0, (unsigned long)crc);
   return 0;
 }
 
 const EshCommand copyfwCommand = {
   .flags = 0,
   .name = "copyfw",
-  .help = "Copy wifi firmware from /firmware to /flash",
+  .help = "Copy or expand wifi firmware from /firmware to /flash",
   .handler = copyfw
 };
 
@@ -319,7 +529,7 @@ const EshCommand copyfwCommand = {
 const EshCommand staCommand = {
   .flags = 0,
   .name = "sta",
-  .help = "--reset | ap pass\ndisassociate/associate with given wifi access point.",
+  .help = "[--reset | ap pass]\ndisassociate/associate with given wifi access point.",
   .handler = sta
 }; 
 
@@ -338,7 +548,18 @@ const EshCommand clearCommand = {
 }; 
 
 extern const EshCommand mqttCommand;
+extern const EshCommand pubCommand;
 extern const EshCommand apCommand;
+extern const EshCommand sensorsCommand;
+extern const EshCommand schedCommand;
+extern const EshCommand pulseCommand;
+extern const EshCommand psCommand;
+extern const EshCommand otaCommand;
+extern const EshCommand topCommand;
+extern const EshCommand traceCommand;
+extern const EshCommand sleepCommand;
+extern const EshCommand memCommand;
+extern const EshCommand displayCommand;
 
 const EshCommand *eshCommandList[] = {
 
@@ -346,6 +567,7 @@ const EshCommand *eshCommandList[] = {
   &copyfwCommand,
 #endif
   &mqttCommand,
+  &pubCommand,
   &staCommand,
   &apCommand,
   &wrCommand,
@@ -353,6 +575,18 @@ const EshCommand *eshCommandList[] = {
 #if defined(POS_DEBUGHELP) || NOSCFG_FEATURE_REGISTRY
   &eshTsCommand,
   &eshEsCommand,
+#endif
+  &sensorsCommand,
+  &schedCommand,
+  &pulseCommand,
+  &psCommand,
+  &otaCommand,
+  &topCommand,
+  &sleepCommand,
+  &memCommand,
+  &displayCommand,
+#if TRACE
+  &traceCommand,
 #endif
   &eshOnewireCommand,
   &eshPingCommand,
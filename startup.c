@@ -131,6 +131,16 @@ PORT_WEAK_HANDLER(CRYP_irq);
 PORT_WEAK_HANDLER(HASH_RNG_irq);
 PORT_WEAK_HANDLER(FPU_irq);
 
+/*
+ * Wrappers that record wakeup source before
+ * calling real handler, see sleep.c.
+ */
+void sleepRtcIrq(void);
+void sleepSdioIrq(void);
+void sleepUartIrq(void);
+void sleepTimerIrq(void);
+void sleepPulseIrq(void);
+
 PortExcHandlerFunc vectorTable[] __attribute__ ((section(".vectors"))) =
 { (PortExcHandlerFunc) __stack,        // stack pointer
     Reset_Handler,                     // code entry point
@@ -152,7 +162,7 @@ PortExcHandlerFunc vectorTable[] __attribute__ ((section(".vectors"))) =
     WWDG_irq,                   // Window WatchDog
     PVD_irq,                    // PVD through EXTI Line detection
     TAMP_STAMP_irq,             // Tamper and TimeStamps through the EXTI line
-    RTC_WKUP_IRQHandler,        // RTC Wakeup through the EXTI line
+    sleepRtcIrq,                // RTC Wakeup through the EXTI line
     FLASH_irq,                  // FLASH
     RCC_irq,                    // RCC
     EXTI0_irq,                  // EXTI Line0
@@ -172,7 +182,7 @@ PortExcHandlerFunc vectorTable[] __attribute__ ((section(".vectors"))) =
     CAN1_RX0_irq,               // CAN1 RX0
     CAN1_RX1_irq,               // CAN1 RX1
     CAN1_SCE_irq,               // CAN1 SCE
-    EXTI9_5_irq,                // External Line[9:5]s
+    sleepPulseIrq,              // External Line[9:5]s
     TIM1_BRK_TIM9_irq,          // TIM1 Break and TIM9
     TIM1_UP_TIM10_irq,          // TIM1 Update and TIM10
     TIM1_TRG_COM_TIM11_irq,     // TIM1 Trigger and Commutation and TIM11
@@ -187,7 +197,7 @@ PortExcHandlerFunc vectorTable[] __attribute__ ((section(".vectors"))) =
     SPI1_irq,                   // SPI1
     SPI2_irq,                   // SPI2
     USART1_IRQHandler,          // USART1
-    USART2_IRQHandler,          // USART2
+    sleepUartIrq,               // USART2
     USART3_IRQHandler,          // USART3
     EXTI15_10_irq,              // External Line[15:10]s
     RTC_Alarm_irq,              // RTC Alarm (A and B) through EXTI Line
@@ -198,8 +208,8 @@ PortExcHandlerFunc vectorTable[] __attribute__ ((section(".vectors"))) =
     TIM8_CC_irq,                // TIM8 Capture Compare
     DMA1_Stream7_irq,           // DMA1 Stream7
     FSMC_irq,                   // FSMC
-    SDIO_irq,                   // SDIO
-    TIM5_irq,                   // TIM5
+    sleepSdioIrq,               // SDIO
+    sleepTimerIrq,              // TIM5
     SPI3_irq,                   // SPI3
     UART4_IRQHandler,           // UART4
     UART5_IRQHandler,           // UART5
@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compare json and cbor payload size and scan time.
+ * Messages are read from capture file (same format as
+ * for emw-host), each json payload is converted to cbor
+ * and both are scanned with the path potato.c uses for
+ * the topic. Values found are checked to be equal.
+ *
+ * usage: cborbench [-t ms] capture
+ */
+
+#define _GNU_SOURCE
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "emw-meter.h"
+
+#define MAX_PAYLOAD 4096
+#define MAX_KEY     64
+
+/*
+ * Topics and paths, same as in potato.c.
+ */
+typedef struct {
+
+  const char* topic;
+  const char* path;
+  int         count;
+  long        jsonBytes;
+  long        cborBytes;
+  int         mismatches;
+  double      jsonNs;
+  double      cborNs;
+} Topic;
+
+static Topic topics[] = {
+
+  { .topic = "ts/davis/home", .path = "locations.outside.temperature" },
+  { .topic = "ts/emeter",     .path = "locations.emeter.power" },
+  { .topic = "forecast/fmi",  .path = "weatherSymbol3" },
+};
+
+#define TOPIC_COUNT (int)(sizeof(topics) / sizeof(Topic))
+
+typedef struct {
+
+  Topic*   topic;
+  uint8_t* json;
+  int      jsonLen;
+  uint8_t* cbor;
+  int      cborLen;
+} Message;
+
+static Message* messages;
+static int      messageCount;
+
+/*
+ * Minimal json to cbor converter. Containers are walked
+ * twice, first to count items for cbor header.
+ */
+typedef struct {
+
+  const char* p;
+  const char* end;
+} Json;
+
+static int convertValue(Json* js, CborEnc* enc);
+
+static void skipSpace(Json* js)
+{
+  while (js->p < js->end && (*js->p == ' ' || *js->p == '\t' || *js->p == '\r' || *js->p == '\n'))
+    ++js->p;
+}
+
+static void encByte(CborEnc* enc, uint8_t b)
+{
+  if (enc->len < enc->max)
+    enc->buf[enc->len++] = b;
+  else
+    enc->overflow = true;
+}
+
+static int convertString(Json* js, CborEnc* enc)
+{
+  char str[MAX_PAYLOAD];
+  int len = 0;
+  char c;
+
+  ++js->p;
+  while (js->p < js->end && *js->p != '"') {
+
+    c = *js->p++;
+    if (c == '\\' && js->p < js->end) {
+
+      c = *js->p++;
+      switch (c) {
+      case 'n': c = '\n'; break;
+      case 't': c = '\t'; break;
+      case 'r': c = '\r'; break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'u':
+        js->p += 4;
+        c = '?';
+        break;
+      }
+    }
+
+    if (len < MAX_PAYLOAD - 1)
+      str[len++] = c;
+  }
+
+  if (js->p >= js->end)
+    return -1;
+
+  ++js->p;
+  str[len] = '\0';
+  if (enc != NULL)
+    cborEncText(enc, str);
+
+  return 0;
+}
+
+static int convertNumber(Json* js, CborEnc* enc)
+{
+  char* end;
+  double d = strtod(js->p, &end);
+  bool integer = true;
+  const char* s;
+
+  if (end == js->p)
+    return -1;
+
+  for (s = js->p; s < end; s++)
+    if (*s == '.' || *s == 'e' || *s == 'E')
+      integer = false;
+
+  js->p = end;
+  if (enc == NULL)
+    return 0;
+
+  if (integer && d >= -2147483647.0 && d <= 2147483647.0)
+    cborEncInt(enc, (int)d);
+  else
+    cborEncFloat(enc, d);
+
+  return 0;
+}
+
+static int convertItems(Json* js, CborEnc* enc, bool object)
+{
+  char close = object ? '}' : ']';
+  int count = 0;
+
+  skipSpace(js);
+  if (js->p < js->end && *js->p == close) {
+
+    ++js->p;
+    return 0;
+  }
+
+  while (js->p < js->end) {
+
+    if (object) {
+
+      skipSpace(js);
+      if (*js->p != '"' || convertString(js, enc) < 0)
+        return -1;
+
+      skipSpace(js);
+      if (js->p >= js->end || *js->p++ != ':')
+        return -1;
+    }
+
+    if (convertValue(js, enc) < 0)
+      return -1;
+
+    ++count;
+    skipSpace(js);
+    if (js->p >= js->end)
+      return -1;
+
+    if (*js->p == ',') {
+
+      ++js->p;
+      continue;
+    }
+
+    if (*js->p++ == close)
+      return count;
+
+    return -1;
+  }
+
+  return -1;
+}
+
+static int convertContainer(Json* js, CborEnc* enc, bool object)
+{
+  Json counter;
+  int count;
+
+  ++js->p;
+  if (enc == NULL)
+    return convertItems(js, NULL, object);
+
+  counter = *js;
+  count = convertItems(&counter, NULL, object);
+  if (count < 0)
+    return -1;
+
+  if (object)
+    cborEncMap(enc, count);
+  else
+    cborEncArray(enc, count);
+
+  return convertItems(js, enc, object) == count ? 0 : -1;
+}
+
+static int convertValue(Json* js, CborEnc* enc)
+{
+  static const struct {
+
+    const char* name;
+    uint8_t     simple;
+  } literals[] = { { "false", 0xf4 }, { "true", 0xf5 }, { "null", 0xf6 } };
+  int i;
+  int len;
+
+  skipSpace(js);
+  if (js->p >= js->end)
+    return -1;
+
+  switch (*js->p) {
+  case '{':
+    return convertContainer(js, enc, true);
+
+  case '[':
+    return convertContainer(js, enc, false);
+
+  case '"':
+    return convertString(js, enc);
+  }
+
+  for (i = 0; i < 3; i++) {
+
+    len = strlen(literals[i].name);
+    if (js->end - js->p >= len && !memcmp(js->p, literals[i].name, len)) {
+
+      js->p += len;
+      if (enc != NULL)
+        encByte(enc, literals[i].simple);
+
+      return 0;
+    }
+  }
+
+  return convertNumber(js, enc);
+}
+
+static int jsonToCbor(const uint8_t* json, int len, uint8_t* buf, int max)
+{
+  Json js = { (const char*)json, (const char*)json + len };
+  CborEnc enc;
+
+  cborEncInit(&enc, buf, max);
+  if (convertValue(&js, &enc) < 0)
+    return -1;
+
+  return cborEncEnd(&enc);
+}
+
+static int loadCapture(const char* file)
+{
+  FILE* fp = fopen(file, "r");
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  char* sp;
+  uint8_t buf[MAX_PAYLOAD];
+  Message* m;
+  int i;
+
+  if (fp == NULL) {
+
+    perror(file);
+    return -1;
+  }
+
+  while ((len = getline(&line, &size, fp)) > 0) {
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+
+    sp = strchr(line, ' ');
+    if (line[0] == '#' || sp == NULL)
+      continue;
+
+    *sp = '\0';
+    for (i = 0; i < TOPIC_COUNT; i++)
+      if (!strcmp(topics[i].topic, line))
+        break;
+
+    if (i == TOPIC_COUNT)
+      continue;
+
+    messages = realloc(messages, (messageCount + 1) * sizeof(Message));
+    m = &messages[messageCount];
+    m->topic = &topics[i];
+    m->jsonLen = len - (sp - line) - 1;
+    m->json = (uint8_t*)strndup(sp + 1, m->jsonLen);
+    m->cborLen = jsonToCbor(m->json, m->jsonLen, buf, sizeof(buf));
+    if (m->cborLen < 0) {
+
+      fprintf(stderr, "%s: cannot convert payload\n", line);
+      continue;
+    }
+
+    m->cbor = malloc(m->cborLen);
+    memcpy(m->cbor, buf, m->cborLen);
+    ++messageCount;
+  }
+
+  free(line);
+  fclose(fp);
+  return messageCount;
+}
+
+static float scanJson(Message* m)
+{
+  JsonScanTarget t = { .path = m->topic->path };
+  JsonScan scan;
+
+  jsonScanInit(&scan, &t, 1);
+  jsonScanFeed(&scan, m->json, m->jsonLen);
+  if (jsonScanEnd(&scan) < 0)
+    return MISSING_VALUE;
+
+  return t.value;
+}
+
+static float scanCbor(Message* m)
+{
+  JsonScanTarget t = { .path = m->topic->path };
+  CborScan scan;
+
+  cborScanInit(&scan, &t, 1);
+  cborScanFeed(&scan, m->cbor, m->cborLen);
+  if (cborScanEnd(&scan) < 0)
+    return MISSING_VALUE;
+
+  return t.value;
+}
+
+static uint64_t nanos(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Scan all messages of topic repeatedly for
+ * given time, return average time per message.
+ */
+static double timeScan(Topic* t, float (*scan)(Message*), int ms)
+{
+  uint64_t start = nanos();
+  uint64_t elapsed;
+  volatile float sink;
+  long scans = 0;
+  int i;
+
+  do {
+
+    for (i = 0; i < messageCount; i++) {
+
+      if (messages[i].topic != t)
+        continue;
+
+      sink = scan(&messages[i]);
+      ++scans;
+    }
+
+    elapsed = nanos() - start;
+  } while (elapsed < (uint64_t)ms * 1000000);
+
+  (void)sink;
+  return scans ? (double)elapsed / scans : 0;
+}
+
+int main(int argc, char** argv)
+{
+  int ms = 200;
+  int opt;
+  int i;
+  Message* m;
+  Topic* t;
+  float jv, cv;
+
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+
+    switch (opt) {
+    case 't':
+      ms = atoi(optarg);
+      break;
+
+    default:
+      fprintf(stderr, "usage: %s [-t ms] capture\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || loadCapture(argv[optind]) <= 0)
+    return 1;
+
+  for (i = 0, m = messages; i < messageCount; i++, m++) {
+
+    t = m->topic;
+    ++t->count;
+    t->jsonBytes += m->jsonLen;
+    t->cborBytes += m->cborLen;
+
+    jv = scanJson(m);
+    cv = scanCbor(m);
+    if (jv != cv)
+      ++t->mismatches;
+  }
+
+  printf("%-14s %5s %7s %7s %6s %8s %8s %6s\n",
+         "topic", "msgs", "json B", "cbor B", "size", "json ns", "cbor ns", "time");
+
+  for (i = 0, t = topics; i < TOPIC_COUNT; i++, t++) {
+
+    if (t->count == 0)
+      continue;
+
+    t->jsonNs = timeScan(t, scanJson, ms);
+    t->cborNs = timeScan(t, scanCbor, ms);
+    printf("%-14s %5d %7ld %7ld %5.0f%% %8.0f %8.0f %5.0f%%\n",
+           t->topic, t->count,
+           t->jsonBytes / t->count,
+           t->cborBytes / t->count,
+           100.0 * t->cborBytes / t->jsonBytes,
+           t->jsonNs, t->cborNs,
+           100.0 * t->cborNs / t->jsonNs);
+
+    if (t->mismatches)
+      printf("%-14s %d values differ between json and cbor\n", t->topic, t->mismatches);
+  }
+
+  return 0;
+}
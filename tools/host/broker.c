@@ -0,0 +1,675 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mock mqtt broker for host build. Accepts connection from
+ * potatoTask, waits until it has subscribed and replays captured
+ * traffic to it. Capture is output of "mosquitto_sub -v", one
+ * message per line: topic, space and payload. Reports message
+ * rate, latency from send to history update of channel and
+ * heap allocations made while messages were handled.
+ *
+ * usage: emw-host [-p port] [-n repeat] [-r rate] [-s server] capture
+ */
+
+#define _GNU_SOURCE
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "emw-meter.h"
+#include "host.h"
+
+#define MAX_MESSAGES 1024
+#define MAX_TOPICS   8
+#define MAX_TOPIC    128
+#define RING_SIZE    4096
+
+#define MQ_CONNECT    1
+#define MQ_PUBLISH    3
+#define MQ_SUBSCRIBE  8
+#define MQ_PINGREQ    12
+#define MQ_DISCONNECT 14
+
+/*
+ * Topics that end up in history of a channel,
+ * same as in subscription table of potato.c.
+ */
+typedef struct {
+
+  const char* topic;
+  Channel*    channel;
+} HistoryTopic;
+
+static const HistoryTopic historyTopics[] = {
+
+  { "ts/davis/home", &outsideChannel },
+  { "ts/emeter",     &powerChannel },
+};
+
+#define HISTORY_COUNT (int)(sizeof(historyTopics) / sizeof(HistoryTopic))
+
+typedef struct {
+
+  char*    name;
+  int      len;
+  int      history;
+  bool     subscribed;
+} Topic;
+
+typedef struct {
+
+  Topic*   topic;
+  uint8_t* payload;
+  int      len;
+} Message;
+
+/*
+ * Send times of messages in flight, one
+ * ring for each history topic.
+ */
+typedef struct {
+
+  uint64_t sent[RING_SIZE];
+  unsigned head;
+  unsigned tail;
+} Ring;
+
+static Topic   topics[MAX_TOPICS];
+static int     topicCount;
+static Message messages[MAX_MESSAGES];
+static int     messageCount;
+
+static Ring    rings[HISTORY_COUNT];
+static pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int      clientSock = -1;
+static volatile bool     connected;
+static volatile uint64_t lastSubscribe;
+static volatile unsigned long scanned;
+static volatile unsigned long received;
+static volatile uint64_t lastDone;
+
+static uint64_t*     latencies;
+static unsigned long latencyCount;
+static unsigned long latencyMax;
+
+/*
+ * Hooks into firmware code (ld --wrap). Scanner end
+ * means that message has been handled, history update
+ * completes latency measurement of message.
+ */
+int __real_jsonScanEnd(JsonScan* scan);
+int __real_cborScanEnd(CborScan* scan);
+void __real_channelSample(Channel* ch);
+
+int __wrap_jsonScanEnd(JsonScan* scan)
+{
+  int st = __real_jsonScanEnd(scan);
+
+  __atomic_add_fetch(&scanned, 1, __ATOMIC_RELAXED);
+  lastDone = hostMicros();
+  return st;
+}
+
+int __wrap_cborScanEnd(CborScan* scan)
+{
+  int st = __real_cborScanEnd(scan);
+
+  __atomic_add_fetch(&scanned, 1, __ATOMIC_RELAXED);
+  lastDone = hostMicros();
+  return st;
+}
+
+void __wrap_channelSample(Channel* ch)
+{
+  uint64_t now;
+  Ring* r;
+  int i;
+
+  __real_channelSample(ch);
+  now = hostMicros();
+
+  for (i = 0; i < HISTORY_COUNT; i++) {
+
+    if (historyTopics[i].channel != ch)
+      continue;
+
+    r = &rings[i];
+    pthread_mutex_lock(&ringMutex);
+    if (r->tail != r->head) {
+
+      if (latencyCount < latencyMax)
+        latencies[latencyCount++] = now - r->sent[r->tail % RING_SIZE];
+
+      ++r->tail;
+    }
+
+    pthread_mutex_unlock(&ringMutex);
+  }
+
+  lastDone = now;
+}
+
+static Topic* addTopic(const char* name, int len)
+{
+  int i;
+  Topic* t;
+
+  for (i = 0, t = topics; i < topicCount; i++, t++)
+    if (t->len == len && !memcmp(t->name, name, len))
+      return t;
+
+  if (topicCount == MAX_TOPICS)
+    return NULL;
+
+  t = &topics[topicCount++];
+  t->name = strndup(name, len);
+  t->len = len;
+  t->history = -1;
+  for (i = 0; i < HISTORY_COUNT; i++)
+    if (!strcmp(historyTopics[i].topic, t->name))
+      t->history = i;
+
+  return t;
+}
+
+static int loadCapture(const char* file)
+{
+  FILE* fp = fopen(file, "r");
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  char* sp;
+  Message* m;
+
+  if (fp == NULL) {
+
+    perror(file);
+    return -1;
+  }
+
+  while ((len = getline(&line, &size, fp)) > 0 && messageCount < MAX_MESSAGES) {
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+
+    sp = strchr(line, ' ');
+    if (line[0] == '#' || sp == NULL || sp - line > MAX_TOPIC)
+      continue;
+
+    m = &messages[messageCount];
+    m->topic = addTopic(line, sp - line);
+    if (m->topic == NULL)
+      continue;
+
+    m->len = len - (sp - line) - 1;
+    m->payload = (uint8_t*)strndup(sp + 1, m->len);
+    ++messageCount;
+  }
+
+  free(line);
+  fclose(fp);
+  return messageCount;
+}
+
+static int readFully(int sock, uint8_t* buf, int len)
+{
+  int got;
+
+  while (len > 0) {
+
+    got = read(sock, buf, len);
+    if (got <= 0)
+      return -1;
+
+    buf += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+static int writeFully(int sock, const uint8_t* buf, int len)
+{
+  int got;
+
+  while (len > 0) {
+
+    got = write(sock, buf, len);
+    if (got <= 0)
+      return -1;
+
+    buf += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
+static int encodeLength(uint8_t* buf, int len)
+{
+  int n = 0;
+
+  do {
+
+    buf[n] = len % 128;
+    len /= 128;
+    if (len > 0)
+      buf[n] |= 0x80;
+
+    ++n;
+  } while (len > 0);
+
+  return n;
+}
+
+static int sendPacket(const uint8_t* head, int headLen, const uint8_t* body, int bodyLen)
+{
+  int st;
+
+  pthread_mutex_lock(&writeMutex);
+  st = writeFully(clientSock, head, headLen);
+  if (st == 0 && bodyLen > 0)
+    st = writeFully(clientSock, body, bodyLen);
+
+  pthread_mutex_unlock(&writeMutex);
+  return st;
+}
+
+static int sendPublish(const Message* m)
+{
+  uint8_t head[7 + MAX_TOPIC];
+  int n;
+
+  head[0] = MQ_PUBLISH << 4;
+  n = 1 + encodeLength(head + 1, 2 + m->topic->len + m->len);
+  head[n++] = m->topic->len >> 8;
+  head[n++] = m->topic->len & 0xff;
+  memcpy(head + n, m->topic->name, m->topic->len);
+  n += m->topic->len;
+  return sendPacket(head, n, m->payload, m->len);
+}
+
+static void subscribe(const uint8_t* body, int len)
+{
+  uint8_t ack[4 + MAX_TOPICS];
+  int filters = 0;
+  int flen;
+  int i;
+  Topic* t;
+
+  for (i = 2; i + 2 <= len; i += 2 + flen + 1) {
+
+    flen = (body[i] << 8) | body[i + 1];
+    if (i + 2 + flen + 1 > len)
+      break;
+
+    for (t = topics; t < topics + topicCount; t++)
+      if (t->len == flen && !memcmp(t->name, body + i + 2, flen))
+        t->subscribed = true;
+
+    if (filters < MAX_TOPICS)
+      ++filters;
+  }
+
+  ack[0] = 0x90;
+  ack[1] = 2 + filters;
+  ack[2] = body[0];
+  ack[3] = body[1];
+  memset(ack + 4, '\0', filters);
+  sendPacket(ack, 4 + filters, NULL, 0);
+  lastSubscribe = hostMicros();
+}
+
+/*
+ * Handle packets from client: connect, subscribe,
+ * ping and publishes (which are only counted).
+ */
+static void* clientReader(void* arg)
+{
+  static uint8_t body[4096];
+  static const uint8_t connack[] = { 0x20, 2, 0, 0 };
+  static const uint8_t pingresp[] = { 0xd0, 0 };
+  uint8_t b;
+  int type;
+  int len;
+  int shift;
+  int n;
+
+  while (readFully(clientSock, &b, 1) == 0) {
+
+    type = b >> 4;
+    len = 0;
+    shift = 0;
+    do {
+
+      if (readFully(clientSock, &b, 1) < 0)
+        goto out;
+
+      len |= (b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+
+    n = len > (int)sizeof(body) ? (int)sizeof(body) : len;
+    if (readFully(clientSock, body, n) < 0)
+      break;
+
+    for (len -= n; len > 0; len--)
+      if (readFully(clientSock, &b, 1) < 0)
+        goto out;
+
+    switch (type) {
+    case MQ_CONNECT:
+      sendPacket(connack, sizeof(connack), NULL, 0);
+      break;
+
+    case MQ_SUBSCRIBE:
+      subscribe(body, n);
+      break;
+
+    case MQ_PINGREQ:
+      sendPacket(pingresp, sizeof(pingresp), NULL, 0);
+      break;
+
+    case MQ_PUBLISH:
+      ++received;
+      break;
+
+    case MQ_DISCONNECT:
+      goto out;
+    }
+  }
+
+out:
+  connected = false;
+  return NULL;
+}
+
+static int listenOn(int port)
+{
+  struct sockaddr_in addr;
+  int sock;
+  int on = 1;
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+
+    perror("listen");
+    return -1;
+  }
+
+  return sock;
+}
+
+/*
+ * Wait for connection and until client has not
+ * subscribed anything new for a while.
+ */
+static int waitClient(int listenSock)
+{
+  struct pollfd pfd = { .fd = listenSock, .events = POLLIN };
+  pthread_t reader;
+
+  if (poll(&pfd, 1, 10000) <= 0) {
+
+    fprintf(stderr, "client did not connect\n");
+    return -1;
+  }
+
+  clientSock = accept(listenSock, NULL, NULL);
+  connected = true;
+  pthread_create(&reader, NULL, clientReader, NULL);
+  pthread_detach(reader);
+
+  while (connected && (lastSubscribe == 0 || hostMicros() - lastSubscribe < 500000))
+    usleep(10000);
+
+  return connected ? 0 : -1;
+}
+
+static void pushSent(int history, uint64_t now)
+{
+  Ring* r = &rings[history];
+
+  while (true) {
+
+    pthread_mutex_lock(&ringMutex);
+    if (r->head - r->tail < RING_SIZE) {
+
+      r->sent[r->head++ % RING_SIZE] = now;
+      pthread_mutex_unlock(&ringMutex);
+      return;
+    }
+
+    pthread_mutex_unlock(&ringMutex);
+    usleep(100);
+  }
+}
+
+static bool ringsEmpty(void)
+{
+  bool empty = true;
+  int i;
+
+  pthread_mutex_lock(&ringMutex);
+  for (i = 0; i < HISTORY_COUNT; i++)
+    if (rings[i].head != rings[i].tail)
+      empty = false;
+
+  pthread_mutex_unlock(&ringMutex);
+  return empty;
+}
+
+static int compareU64(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv)
+{
+  int port = 1883;
+  int repeat = 100;
+  int rate = 0;
+  const char* server = "127.0.0.1";
+  int listenSock;
+  int opt;
+  int i, r;
+  unsigned long sent = 0;
+  unsigned long historySent = 0;
+  unsigned long bytes = 0;
+  unsigned long allocs, frees, allocBytes;
+  unsigned long done;
+  uint64_t start, elapsed, idle, sum;
+  Message* m;
+
+  while ((opt = getopt(argc, argv, "p:n:r:s:")) != -1) {
+
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+
+    case 'n':
+      repeat = atoi(optarg);
+      break;
+
+    case 'r':
+      rate = atoi(optarg);
+      break;
+
+    case 's':
+      server = optarg;
+      break;
+
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-n repeat] [-r rate] [-s server] capture\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || loadCapture(argv[optind]) <= 0)
+    return 1;
+
+  listenSock = listenOn(port);
+  if (listenSock < 0)
+    return 1;
+
+  uosConfigSet("mqtt.server", server);
+  channelInit();
+  memInit();
+  potatoStart();
+
+  if (waitClient(listenSock) < 0)
+    return 1;
+
+  for (i = 0; i < topicCount; i++)
+    if (!topics[i].subscribed)
+      fprintf(stderr, "warning: %s is not subscribed, not sent\n", topics[i].name);
+
+  for (i = 0, m = messages; i < messageCount; i++, m++)
+    if (m->topic->subscribed && m->topic->history >= 0)
+      latencyMax += repeat;
+
+  latencies = malloc((latencyMax + 1) * sizeof(uint64_t));
+
+/*
+ * Replay messages, paced if rate is given.
+ */
+  allocs = hostAllocs;
+  frees = hostFrees;
+  allocBytes = hostAllocBytes;
+  start = hostMicros();
+
+  for (r = 0; r < repeat && connected; r++) {
+
+    for (i = 0, m = messages; i < messageCount && connected; i++, m++) {
+
+      if (!m->topic->subscribed)
+        continue;
+
+      if (rate > 0)
+        while (hostMicros() < start + sent * 1000000ULL / rate)
+          usleep(50);
+
+      if (m->topic->history >= 0) {
+
+        pushSent(m->topic->history, hostMicros());
+        ++historySent;
+      }
+
+      if (sendPublish(m) < 0)
+        break;
+
+      ++sent;
+      bytes += m->len;
+    }
+  }
+
+/*
+ * Wait until everything has been handled, or
+ * nothing has happened for 5 seconds.
+ */
+  idle = hostMicros();
+  done = 0;
+  while (connected && (scanned < sent || !ringsEmpty())) {
+
+    if (scanned != done) {
+
+      done = scanned;
+      idle = hostMicros();
+    }
+    else if (hostMicros() - idle > 5000000)
+      break;
+
+    usleep(1000);
+  }
+
+  allocs = hostAllocs - allocs;
+  frees = hostFrees - frees;
+  allocBytes = hostAllocBytes - allocBytes;
+  elapsed = (lastDone > start ? lastDone : hostMicros()) - start;
+
+  printf("messages %lu (%lu to history), %lu payload bytes, %lu handled\n",
+         sent, historySent, bytes, (unsigned long)scanned);
+  printf("elapsed  %.3f s, %.0f msgs/s\n",
+         elapsed / 1e6, elapsed > 0 ? sent * 1e6 / elapsed : 0.0);
+
+  if (latencyCount > 0) {
+
+    qsort(latencies, latencyCount, sizeof(uint64_t), compareU64);
+    for (sum = 0, i = 0; i < (int)latencyCount; i++)
+      sum += latencies[i];
+
+    printf("latency  min %lu, avg %lu, p50 %lu, p99 %lu, max %lu us\n",
+           (unsigned long)latencies[0],
+           (unsigned long)(sum / latencyCount),
+           (unsigned long)latencies[latencyCount / 2],
+           (unsigned long)latencies[latencyCount * 99 / 100],
+           (unsigned long)latencies[latencyCount - 1]);
+  }
+
+  printf("heap     %lu allocs, %lu frees, %lu bytes\n", allocs, frees, allocBytes);
+  printf("arena    max %d of %d bytes, %lu failed\n",
+         messageArena.highWater, messageArena.size, (unsigned long)messageArena.failures);
+  printf("client   %lu publishes received\n", (unsigned long)received);
+
+  if (!connected)
+    printf("client disconnected\n");
+
+  if (scanned < sent || latencyCount < historySent) {
+
+    printf("lost     %lu messages\n", sent - scanned);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build: minimal Pico]OS api on top of pthreads.
+ * Only what emw-meter sources built on host need.
+ */
+
+#ifndef _PICOOS_H
+#define _PICOOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+typedef unsigned long JIF_t;
+
+#define HZ     1000
+#define MS(ms) ((JIF_t)(ms) * HZ / 1000)
+
+JIF_t hostJiffies(void);
+#define jiffies hostJiffies()
+
+typedef struct hostTask*  POSTASK_t;
+typedef struct hostTask*  NOSTASK_t;
+typedef struct hostMutex* POSMUTEX_t;
+typedef struct hostSema*  POSSEMA_t;
+
+POSMUTEX_t posMutexCreate(void);
+void       posMutexLock(POSMUTEX_t mutex);
+void       posMutexUnlock(POSMUTEX_t mutex);
+
+POSSEMA_t  posSemaCreate(int count);
+void       posSemaGet(POSSEMA_t sema);
+int        posSemaWait(POSSEMA_t sema, JIF_t timeout);
+void       posSemaSignal(POSSEMA_t sema);
+
+void       posTaskSleep(JIF_t ticks);
+NOSTASK_t  nosTaskCreate(void (*func)(void*), void* arg, int prio, int stack, const char* name);
+
+/*
+ * Scheduler lock is a global recursive mutex.
+ */
+void hostSchedLock(void);
+void hostSchedUnlock(void);
+
+#define POS_LOCKFLAGS    int posLockFlags __attribute__((unused))
+#define POS_SCHED_LOCK   hostSchedLock()
+#define POS_SCHED_UNLOCK hostSchedUnlock()
+
+#endif
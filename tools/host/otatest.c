@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host test for ota.c. A stand-in update server streams
+ * an image to "ota" command running on posix sockets,
+ * /flash is a temporary directory. Good image must be
+ * staged and marked ready, image with wrong crc, bad
+ * header, bad size or truncated stream must be rejected
+ * without ready marker.
+ *
+ * usage: otatest
+ */
+
+#define _GNU_SOURCE
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+#include "host.h"
+
+#define IMAGE_LEN 100000
+#define WAIT_MAX  10000
+
+extern const EshCommand otaCommand;
+
+enum {
+  SERVE_GOOD,
+  SERVE_BAD_CRC,
+  SERVE_BAD_MAGIC,
+  SERVE_TOO_BIG,
+  SERVE_TRUNCATED
+};
+
+static uint8_t image[IMAGE_LEN];
+static uint32_t imageCrc;
+static volatile int serveMode;
+static int serverPort;
+
+/*
+ * Spiffs open does not take mode, host one needs it
+ * with O_CREAT. Files under /flash
+ * go to test directory (ld --wrap=open).
+ */
+int __real_open(const char* name, int flags, ...);
+
+int __wrap_open(const char* name, int flags, ...)
+{
+  char buf[256];
+
+  return __real_open(hostPath(name, buf, sizeof(buf)), flags, 0644);
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/*
+ * Stand-in server, like tools/otaserve.py but
+ * header and stream can be broken on purpose.
+ */
+static void* serverThread(void* arg)
+{
+  int srv = (int)(intptr_t)arg;
+  uint8_t hdr[12];
+  int conn;
+  int len;
+
+  while ((conn = accept(srv, NULL, NULL)) >= 0) {
+
+    len = IMAGE_LEN;
+    memcpy(hdr, serveMode == SERVE_BAD_MAGIC ? "OTA0" : "OTA1", 4);
+    put32(hdr + 4, serveMode == SERVE_TOO_BIG ? 1024 * 1024 : IMAGE_LEN);
+    put32(hdr + 8, serveMode == SERVE_BAD_CRC ? imageCrc ^ 1 : imageCrc);
+    if (serveMode == SERVE_TRUNCATED)
+      len = IMAGE_LEN / 2;
+
+    if (write(conn, hdr, sizeof(hdr)) == sizeof(hdr))
+      if (write(conn, image, len) != len)
+        perror("server write");
+
+    close(conn);
+  }
+
+  return NULL;
+}
+
+static void serverStart()
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_t t;
+  int srv;
+
+  srv = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (srv < 0 ||
+      bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(srv, 1) < 0 ||
+      getsockname(srv, (struct sockaddr*)&addr, &len) < 0) {
+
+    perror("server");
+    exit(1);
+  }
+
+  serverPort = ntohs(addr.sin_port);
+  pthread_create(&t, NULL, serverThread, (void*)(intptr_t)srv);
+  pthread_detach(t);
+}
+
+static bool fileExists(const char* name)
+{
+  char buf[256];
+  struct stat st;
+
+  return stat(hostPath(name, buf, sizeof(buf)), &st) == 0;
+}
+
+static bool stagedMatches()
+{
+  char buf[256];
+  static uint8_t staged[IMAGE_LEN + 1];
+  int fd;
+  int len;
+
+  fd = open(hostPath("/flash/ota.bin", buf, sizeof(buf)), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  len = read(fd, staged, sizeof(staged));
+  close(fd);
+  return len == IMAGE_LEN && !memcmp(staged, image, IMAGE_LEN);
+}
+
+static bool readyMatches()
+{
+  char buf[256];
+  char ready[32];
+  char expect[32];
+  int fd;
+  int len;
+
+  fd = open(hostPath("/flash/ota.ready", buf, sizeof(buf)), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  len = read(fd, ready, sizeof(ready) - 1);
+  close(fd);
+  if (len < 0)
+    return false;
+
+  ready[len] = '\0';
+  sprintf(expect, "%lu %08lx\n", (unsigned long)IMAGE_LEN, (unsigned long)imageCrc);
+  return !strcmp(ready, expect);
+}
+
+/*
+ * Run "ota --port n 127.0.0.1" and poll "ota"
+ * until update is done or has failed.
+ */
+static bool runOta(int mode)
+{
+  char port[8];
+  char* args[] = { "--port", port, "127.0.0.1" };
+  EshContext ctx;
+  EshContext status;
+  int waited;
+
+  serveMode = mode;
+  snprintf(port, sizeof(port), "%d", serverPort);
+
+  memset(&ctx, '\0', sizeof(ctx));
+  ctx.argc = 3;
+  ctx.argv = args;
+  if (otaCommand.handler(&ctx) != 0)
+    return false;
+
+  for (waited = 0; waited < WAIT_MAX; waited += 10) {
+
+    posTaskSleep(MS(10));
+    memset(&status, '\0', sizeof(status));
+    otaCommand.handler(&status);
+    if (strstr(status.out, "Update done"))
+      return true;
+
+    if (strstr(status.out, "Update failed"))
+      return false;
+  }
+
+  printf("ota did not finish\n");
+  return false;
+}
+
+static int failures;
+
+static void check(const char* what, bool ok)
+{
+  printf("%-40s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    ++failures;
+}
+
+int main(int argc, char** argv)
+{
+  char dir[] = "/tmp/otatestXXXXXX";
+  uint32_t seed = 1;
+  int i;
+
+  if (mkdtemp(dir) == NULL) {
+
+    perror("mkdtemp");
+    return 1;
+  }
+
+  hostFlashDir = dir;
+  memInit();
+
+  for (i = 0; i < IMAGE_LEN; i++) {
+
+    seed = seed * 1103515245 + 12345;
+    image[i] = seed >> 16;
+  }
+
+  imageCrc = crc32(0, image, IMAGE_LEN);
+  serverStart();
+
+  check("good image accepted", runOta(SERVE_GOOD));
+  check("staged image matches", stagedMatches());
+  check("ready marker has length and crc", readyMatches());
+
+  check("wrong crc rejected", !runOta(SERVE_BAD_CRC));
+  check("no ready marker after wrong crc", !fileExists("/flash/ota.ready"));
+
+  check("bad header rejected", !runOta(SERVE_BAD_MAGIC));
+  check("too big image rejected", !runOta(SERVE_TOO_BIG));
+
+  check("truncated stream rejected", !runOta(SERVE_TRUNCATED));
+  check("no ready marker after truncation", !fileExists("/flash/ota.ready"));
+
+  check("good image accepted after failures", runOta(SERVE_GOOD));
+  check("staged image matches", stagedMatches());
+  check("ready marker has length and crc", readyMatches());
+
+  uosFileUnlink("/flash/ota.bin");
+  uosFileUnlink("/flash/ota.ready");
+  rmdir(dir);
+
+  printf("%d failed\n", failures);
+  return failures ? 1 : 0;
+}
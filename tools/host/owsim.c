@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Slot level 1-Wire simulator for owslot.c. Replaces
+ * usart transfer with a wired-and bus with simulated
+ * DS18B20 devices, which respond to each slot like real
+ * ones do: reset/presence, rom commands including search,
+ * convert and scratchpad read and write. Slot read back
+ * values follow uart timing: start bit pulls bus low, a
+ * device answering 0 holds it low for about 30 us, which
+ * is 3-4 bit times at 115200 baud.
+ *
+ * usage: owsim
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <picoos-ow.h>
+
+#include "emw-meter.h"
+
+#define MAX_DEVICES 4
+
+enum {
+  D_IDLE,
+  D_ROM_CMD,
+  D_MATCH,
+  D_SEARCH,
+  D_FUNC_CMD,
+  D_TX,
+  D_RX,
+  D_DONE
+};
+
+typedef struct {
+
+  uint8_t rom[8];
+  uint8_t scratch[9];
+  int16_t raw;
+  int     state;
+  int     bit;
+  uint8_t byte;
+  int     phase;
+  uint8_t data[9];
+  int     dataLen;
+  int     nextState;
+} Device;
+
+static Device devices[MAX_DEVICES];
+static int    deviceCount;
+static int    level = MODE_NORMAL;
+static long   slots;
+static long   resets;
+
+static uint8_t crc8(const uint8_t* data, int len)
+{
+  uint8_t crc = 0;
+  int i;
+
+  while (len-- > 0) {
+
+    crc ^= *data++;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x8c : crc >> 1;
+  }
+
+  return crc;
+}
+
+/*
+ * Power-on scratchpad has 85 C in temperature
+ * register, until first conversion is done.
+ */
+static void addDevice(uint32_t serial, int16_t raw)
+{
+  Device* d = &devices[deviceCount++];
+  int i;
+
+  memset(d, '\0', sizeof(Device));
+  d->rom[0] = 0x28;
+  for (i = 1; i < 7; i++)
+    d->rom[i] = (serial >> ((i - 1) * 8)) & 0xff;
+
+  d->rom[7] = crc8(d->rom, 7);
+  d->raw = raw;
+  d->scratch[0] = 0x50;
+  d->scratch[1] = 0x05;
+  d->scratch[2] = 0x4b;
+  d->scratch[3] = 0x46;
+  d->scratch[4] = 0x7f;
+  d->scratch[5] = 0xff;
+  d->scratch[6] = 0x0c;
+  d->scratch[7] = 0x10;
+  d->scratch[8] = crc8(d->scratch, 8);
+}
+
+static void transmit(Device* d, const uint8_t* data, int len, int next)
+{
+  memcpy(d->data, data, len);
+  d->dataLen = len;
+  d->bit = 0;
+  d->nextState = next;
+  d->state = D_TX;
+}
+
+static void receive(Device* d, int len, int next)
+{
+  d->dataLen = len;
+  d->bit = 0;
+  d->nextState = next;
+  d->state = D_RX;
+}
+
+static void romCommand(Device* d, uint8_t cmd)
+{
+  d->bit = 0;
+  d->phase = 0;
+  switch (cmd) {
+  case 0x33:
+    transmit(d, d->rom, 8, D_FUNC_CMD);
+    break;
+
+  case 0x55:
+    d->state = D_MATCH;
+    break;
+
+  case 0xcc:
+    d->state = D_FUNC_CMD;
+    break;
+
+  case 0xf0:
+    d->state = D_SEARCH;
+    break;
+
+  default:
+    d->state = D_IDLE;
+    break;
+  }
+}
+
+static void functionCommand(Device* d, uint8_t cmd)
+{
+  d->bit = 0;
+  switch (cmd) {
+  case 0x44:
+    d->scratch[0] = d->raw & 0xff;
+    d->scratch[1] = (d->raw >> 8) & 0xff;
+    d->scratch[8] = crc8(d->scratch, 8);
+    d->state = D_DONE;
+    break;
+
+  case 0xbe:
+    transmit(d, d->scratch, 9, D_DONE);
+    break;
+
+  case 0x4e:
+    receive(d, 3, D_DONE);
+    break;
+
+  default:
+    d->state = D_DONE;
+    break;
+  }
+}
+
+/*
+ * One time slot for one device. Master bit is 1 for
+ * write 1 and read slots. Returns 0 if device pulls
+ * bus low during the slot.
+ */
+static int deviceSlot(Device* d, int master)
+{
+  int romBit;
+  int out = 1;
+
+  switch (d->state) {
+  case D_ROM_CMD:
+  case D_FUNC_CMD:
+    d->byte |= master << d->bit;
+    if (++d->bit == 8) {
+
+      if (d->state == D_ROM_CMD)
+        romCommand(d, d->byte);
+      else
+        functionCommand(d, d->byte);
+
+      d->byte = 0;
+    }
+
+    break;
+
+  case D_MATCH:
+    romBit = (d->rom[d->bit / 8] >> (d->bit % 8)) & 1;
+    if (master != romBit)
+      d->state = D_IDLE;
+    else if (++d->bit == 64) {
+
+      d->bit = 0;
+      d->state = D_FUNC_CMD;
+    }
+
+    break;
+
+  case D_SEARCH:
+    romBit = (d->rom[d->bit / 8] >> (d->bit % 8)) & 1;
+    if (d->phase == 0)
+      out = romBit;
+    else if (d->phase == 1)
+      out = !romBit;
+    else if (master != romBit) {
+
+      d->state = D_IDLE;
+      break;
+    }
+    else if (++d->bit == 64) {
+
+      d->bit = 0;
+      d->state = D_FUNC_CMD;
+    }
+
+    d->phase = (d->phase + 1) % 3;
+    break;
+
+  case D_TX:
+    out = (d->data[d->bit / 8] >> (d->bit % 8)) & 1;
+    if (++d->bit == d->dataLen * 8) {
+
+      d->bit = 0;
+      d->state = d->nextState;
+    }
+
+    break;
+
+  case D_RX:
+    if (master)
+      d->scratch[2 + d->bit / 8] |= 1 << (d->bit % 8);
+    else
+      d->scratch[2 + d->bit / 8] &= ~(1 << (d->bit % 8));
+
+    if (++d->bit == d->dataLen * 8) {
+
+      d->scratch[8] = crc8(d->scratch, 8);
+      d->bit = 0;
+      d->state = d->nextState;
+    }
+
+    break;
+  }
+
+  return out;
+}
+
+/*
+ * Simulated usart transfer, see owuart.c.
+ */
+bool owUartTransfer(uint8_t* buf, int len, bool reset)
+{
+  int i, n;
+  int master;
+  int bus;
+
+  level = MODE_NORMAL;
+  if (reset) {
+
+    ++resets;
+    for (n = 0; n < deviceCount; n++) {
+
+      devices[n].state = D_ROM_CMD;
+      devices[n].bit = 0;
+      devices[n].byte = 0;
+    }
+
+    buf[0] = deviceCount > 0 ? 0xe0 : 0xf0;
+    return true;
+  }
+
+  for (i = 0; i < len; i++) {
+
+    master = buf[i] == 0xff;
+    bus = master;
+    for (n = 0; n < deviceCount; n++)
+      bus &= deviceSlot(&devices[n], master);
+
+    buf[i] = bus ? 0xff : (master ? 0xf8 : 0x00);
+    ++slots;
+  }
+
+  return true;
+}
+
+SMALLINT owLevel(int portnum, SMALLINT newLevel)
+{
+  if (newLevel == MODE_NORMAL || newLevel == MODE_STRONG5)
+    level = newLevel;
+
+  return level;
+}
+
+/*
+ * Rom search, as in application note 187.
+ */
+static int search(uint8_t roms[][8], int max)
+{
+  uint8_t rom[8];
+  int lastDiscrepancy = 0;
+  int lastZero;
+  bool lastDevice = false;
+  int count = 0;
+  int bit;
+  int id, cmp, dir;
+
+  memset(rom, '\0', sizeof(rom));
+  while (!lastDevice && count < max) {
+
+    if (!owTouchReset(0) || !owWriteByte(0, 0xf0))
+      return -1;
+
+    lastZero = 0;
+    for (bit = 1; bit <= 64; bit++) {
+
+      id = owTouchBit(0, 1);
+      cmp = owTouchBit(0, 1);
+      if (id && cmp)
+        return -1;
+
+      if (id != cmp)
+        dir = id;
+      else if (bit < lastDiscrepancy)
+        dir = (rom[(bit - 1) / 8] >> ((bit - 1) % 8)) & 1;
+      else
+        dir = bit == lastDiscrepancy;
+
+      if (id == cmp && dir == 0)
+        lastZero = bit;
+
+      if (dir)
+        rom[(bit - 1) / 8] |= 1 << ((bit - 1) % 8);
+      else
+        rom[(bit - 1) / 8] &= ~(1 << ((bit - 1) % 8));
+
+      owTouchBit(0, dir);
+    }
+
+    if (crc8(rom, 7) != rom[7])
+      return -1;
+
+    memcpy(roms[count++], rom, 8);
+    lastDiscrepancy = lastZero;
+    lastDevice = lastDiscrepancy == 0;
+  }
+
+  return count;
+}
+
+static bool selectDevice(const uint8_t* rom)
+{
+  int i;
+
+  if (!owTouchReset(0))
+    return false;
+
+  if (rom == NULL)
+    return owWriteByte(0, 0xcc);
+
+  if (!owWriteByte(0, 0x55))
+    return false;
+
+  for (i = 0; i < 8; i++)
+    if (!owWriteByte(0, rom[i]))
+      return false;
+
+  return true;
+}
+
+static bool readScratchpad(const uint8_t* rom, uint8_t* scratch)
+{
+  int i;
+
+  if (!selectDevice(rom) || !owWriteByte(0, 0xbe))
+    return false;
+
+  for (i = 0; i < 9; i++)
+    scratch[i] = owReadByte(0);
+
+  return crc8(scratch, 8) == scratch[8];
+}
+
+static int16_t rawTemperature(const uint8_t* scratch)
+{
+  return (int16_t)(scratch[0] | (scratch[1] << 8));
+}
+
+static int failures;
+
+static void check(const char* what, bool ok)
+{
+  printf("%-40s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    ++failures;
+}
+
+int main(int argc, char** argv)
+{
+  uint8_t rom[8];
+  uint8_t roms[MAX_DEVICES][8];
+  uint8_t scratch[9];
+  int n, i, found;
+
+  deviceCount = 0;
+  check("no presence on empty bus", !owTouchReset(0));
+
+  addDevice(0x123456, 21 * 16 + 8);
+  check("presence", owTouchReset(0));
+
+  owWriteByte(0, 0x33);
+  for (i = 0; i < 8; i++)
+    rom[i] = owReadByte(0);
+
+  check("read rom", !memcmp(rom, devices[0].rom, 8));
+
+  check("power-on scratchpad", readScratchpad(NULL, scratch) &&
+                               rawTemperature(scratch) == 0x0550);
+
+  check("skip rom convert with strong pullup",
+        selectDevice(NULL) && owWriteBytePower(0, 0x44) && level == MODE_STRONG5);
+
+  check("read 21.5 C", readScratchpad(NULL, scratch) &&
+                       rawTemperature(scratch) == 21 * 16 + 8 && level == MODE_NORMAL);
+
+  check("write scratchpad", selectDevice(NULL) && owWriteByte(0, 0x4e) &&
+                            owWriteByte(0, 0x11) && owWriteByte(0, 0x22) &&
+                            owWriteByte(0, 0x3f));
+
+  check("resolution in scratchpad", readScratchpad(NULL, scratch) &&
+                                    scratch[2] == 0x11 && scratch[3] == 0x22 &&
+                                    scratch[4] == 0x3f);
+
+  addDevice(0x654321, -10 * 16 - 2);
+  addDevice(0x123457, 85 * 16);
+  found = search(roms, MAX_DEVICES);
+  check("search finds 3 devices", found == 3);
+
+  for (n = 0; n < deviceCount; n++) {
+
+    for (i = 0; i < found; i++)
+      if (!memcmp(roms[i], devices[n].rom, 8))
+        break;
+
+    check("search result matches device", i < found);
+  }
+
+  check("match rom convert", selectDevice(devices[1].rom) && owWriteByte(0, 0x44));
+  check("read -10.125 C with match rom", readScratchpad(devices[1].rom, scratch) &&
+                                         rawTemperature(scratch) == -10 * 16 - 2);
+
+  check("other device not converted", readScratchpad(devices[2].rom, scratch) &&
+                                      rawTemperature(scratch) == 0x0550);
+
+  printf("%ld resets, %ld slots, %d failed\n", resets, slots, failures);
+  return failures ? 1 : 0;
+}
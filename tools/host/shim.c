@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host build support: Pico]OS tasks, mutexes and jiffies on
+ * pthreads, in-memory config store, shell stubs and things that
+ * firmware gets from wifi driver or other modules. Heap calls
+ * made by linked sources are counted (ld --wrap).
+ */
+
+#define _GNU_SOURCE
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <eshell.h>
+
+#include "wwd_wifi.h"
+#include "emw-meter.h"
+#include "host.h"
+
+wiced_mac_t myMac = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+
+Channel sleepChannel = { .name = "sleep", .scale = 10, .value = MISSING_VALUE };
+
+static pthread_mutex_t schedMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct hostMutex {
+
+  pthread_mutex_t mutex;
+};
+
+struct hostSema {
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  int             count;
+};
+
+uint64_t hostMicros()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+JIF_t hostJiffies()
+{
+  return hostMicros() / (1000000 / HZ);
+}
+
+POSMUTEX_t posMutexCreate()
+{
+  POSMUTEX_t m = malloc(sizeof(struct hostMutex));
+
+  pthread_mutex_init(&m->mutex, NULL);
+  return m;
+}
+
+void posMutexLock(POSMUTEX_t m)
+{
+  pthread_mutex_lock(&m->mutex);
+}
+
+void posMutexUnlock(POSMUTEX_t m)
+{
+  pthread_mutex_unlock(&m->mutex);
+}
+
+POSSEMA_t posSemaCreate(int count)
+{
+  POSSEMA_t s = malloc(sizeof(struct hostSema));
+
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->count = count;
+  return s;
+}
+
+void posSemaGet(POSSEMA_t s)
+{
+  pthread_mutex_lock(&s->mutex);
+  while (s->count <= 0)
+    pthread_cond_wait(&s->cond, &s->mutex);
+
+  --s->count;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/*
+ * Returns 0 if semaphore was got, 1 on timeout.
+ */
+int posSemaWait(POSSEMA_t s, JIF_t timeout)
+{
+  struct timespec until;
+  uint64_t ns;
+  int st = 0;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  ns = until.tv_nsec + (uint64_t)timeout * (1000000000 / HZ);
+  until.tv_sec += ns / 1000000000;
+  until.tv_nsec = ns % 1000000000;
+
+  pthread_mutex_lock(&s->mutex);
+  while (s->count <= 0 && st == 0)
+    st = pthread_cond_timedwait(&s->cond, &s->mutex, &until);
+
+  if (s->count > 0) {
+
+    --s->count;
+    st = 0;
+  }
+
+  pthread_mutex_unlock(&s->mutex);
+  return st == 0 ? 0 : 1;
+}
+
+void posSemaSignal(POSSEMA_t s)
+{
+  pthread_mutex_lock(&s->mutex);
+  ++s->count;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+void hostSchedLock()
+{
+  pthread_mutex_lock(&schedMutex);
+}
+
+void hostSchedUnlock()
+{
+  pthread_mutex_unlock(&schedMutex);
+}
+
+void posTaskSleep(JIF_t ticks)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ticks / HZ;
+  ts.tv_nsec = (ticks % HZ) * (1000000000 / HZ);
+  nanosleep(&ts, NULL);
+}
+
+typedef struct {
+
+  void (*func)(void*);
+  void* arg;
+} TaskStart;
+
+static void* taskMain(void* arg)
+{
+  TaskStart start = *(TaskStart*)arg;
+
+  free(arg);
+  start.func(start.arg);
+  return NULL;
+}
+
+/*
+ * Priority and stack size are ignored,
+ * host threads get default stack.
+ */
+NOSTASK_t nosTaskCreate(void (*func)(void*), void* arg, int prio, int stack, const char* name)
+{
+  pthread_t t;
+  TaskStart* start;
+
+  start = malloc(sizeof(TaskStart));
+  if (start == NULL) {
+
+    fprintf(stderr, "%s: cannot create task\n", name);
+    exit(1);
+  }
+
+  start->func = func;
+  start->arg = arg;
+  if (pthread_create(&t, NULL, taskMain, start) != 0) {
+
+    fprintf(stderr, "%s: cannot create task\n", name);
+    exit(1);
+  }
+
+  pthread_detach(t);
+  return (NOSTASK_t)t;
+}
+
+#define MAX_CONFIG 16
+
+static struct {
+
+  char* key;
+  char* value;
+} config[MAX_CONFIG];
+
+const char* uosConfigGet(const char* key)
+{
+  int i;
+
+  for (i = 0; i < MAX_CONFIG; i++)
+    if (config[i].key != NULL && !strcmp(config[i].key, key))
+      return config[i].value;
+
+  return NULL;
+}
+
+int uosConfigSet(const char* key, const char* value)
+{
+  int i;
+  int freeSlot = -1;
+
+  for (i = 0; i < MAX_CONFIG; i++) {
+
+    if (config[i].key == NULL) {
+
+      if (freeSlot == -1)
+        freeSlot = i;
+    }
+    else if (!strcmp(config[i].key, key)) {
+
+      free(config[i].value);
+      config[i].value = strdup(value);
+      return 0;
+    }
+  }
+
+  if (freeSlot == -1)
+    return -1;
+
+  config[freeSlot].key = strdup(key);
+  config[freeSlot].value = strdup(value);
+  return 0;
+}
+
+char* eshNamedArg(EshContext* ctx, const char* name, bool hasValue)
+{
+  int i;
+
+  if (ctx == NULL)
+    return NULL;
+
+  for (i = 0; i < ctx->argc; i++) {
+
+    if (strncmp(ctx->argv[i], "--", 2) || strcmp(ctx->argv[i] + 2, name))
+      continue;
+
+    ctx->used |= 1 << i;
+    if (!hasValue)
+      return ctx->argv[i];
+
+    if (i + 1 == ctx->argc)
+      return NULL;
+
+    ctx->used |= 1 << (i + 1);
+    return ctx->argv[i + 1];
+  }
+
+  return NULL;
+}
+
+char* eshNextArg(EshContext* ctx, bool optional)
+{
+  int i;
+
+  if (ctx == NULL)
+    return NULL;
+
+  for (i = 0; i < ctx->argc; i++) {
+
+    if (!(ctx->used & (1 << i))) {
+
+      ctx->used |= 1 << i;
+      return ctx->argv[i];
+    }
+  }
+
+  return NULL;
+}
+
+void eshCheckNamedArgsUsed(EshContext* ctx)
+{
+}
+
+void eshCheckArgsUsed(EshContext* ctx)
+{
+}
+
+int eshArgError(EshContext* ctx)
+{
+  return EshOK;
+}
+
+void eshPrintf(EshContext* ctx, const char* fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  if (ctx == NULL)
+    return;
+
+  len = strlen(ctx->out);
+  va_start(ap, fmt);
+  vsnprintf(ctx->out + len, sizeof(ctx->out) - len, fmt, ap);
+  va_end(ap);
+}
+
+/*
+ * Files under /flash go to hostFlashDir.
+ */
+const char* hostFlashDir;
+
+const char* hostPath(const char* name, char* buf, int max)
+{
+  if (hostFlashDir == NULL || strncmp(name, "/flash/", 7))
+    return name;
+
+  snprintf(buf, max, "%s/%s", hostFlashDir, name + 7);
+  return buf;
+}
+
+int uosFileUnlink(const char* name)
+{
+  char buf[256];
+
+  if (unlink(hostPath(name, buf, sizeof(buf))) == -1 && errno != ENOENT)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * No radio, so no power save timing.
+ */
+JIF_t wifiReceiveTimeout()
+{
+  return 0;
+}
+
+void wifiLatency(JIF_t latency)
+{
+}
+
+/*
+ * No pulse input, power comes from mqtt.
+ */
+bool pulseActive()
+{
+  return false;
+}
+
+void sleepStats(SleepStats* st)
+{
+  memset(st, '\0', sizeof(SleepStats));
+}
+
+/*
+ * Heap usage of linked sources.
+ */
+volatile unsigned long hostAllocs;
+volatile unsigned long hostFrees;
+volatile unsigned long hostAllocBytes;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void  __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size)
+{
+  __atomic_add_fetch(&hostAllocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hostAllocBytes, size, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+  __atomic_add_fetch(&hostAllocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hostAllocBytes, n * size, __ATOMIC_RELAXED);
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+  __atomic_add_fetch(&hostAllocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hostAllocBytes, size, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void* ptr)
+{
+  if (ptr != NULL)
+    __atomic_add_fetch(&hostFrees, 1, __ATOMIC_RELAXED);
+
+  __real_free(ptr);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * LZSS compressor for files stored in romfs. This is a host
+ * tool, run by gen_romfs.sh. Format is a 12 byte header
+ * ("LZS1", original length and crc32, both little endian)
+ * followed by groups of one flag byte and eight items. Flag bit
+ * set means literal byte, clear means 2 byte back reference
+ * with 11 bit distance and 5 bit length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WINDOW    2048
+#define MIN_MATCH 3
+#define MAX_MATCH (MIN_MATCH + 31)
+#define HASH_SIZE 4096
+
+static uint32_t crc32(uint32_t crc, const uint8_t* buf, long len)
+{
+  int k;
+
+  crc = ~crc;
+  while (len--) {
+
+    crc ^= *buf++;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+  }
+
+  return ~crc;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static int hash(const uint8_t* p)
+{
+  return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+int main(int argc, char** argv)
+{
+  FILE* f;
+  uint8_t* in;
+  uint8_t* out;
+  long len, pos, outLen, flagPos;
+  long* head;
+  long* prev;
+  int item;
+  uint8_t hdr[12];
+
+  if (argc != 2) {
+
+    fprintf(stderr, "usage: lzpack file > file.lz\n");
+    return 1;
+  }
+
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+
+    perror(argv[1]);
+    return 1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  in = malloc(len + 1);
+  out = malloc(len + len / 8 + 16);
+  head = malloc(HASH_SIZE * sizeof(long));
+  prev = malloc((len + 1) * sizeof(long));
+  if (!in || !out || !head || !prev || fread(in, 1, len, f) != (size_t)len) {
+
+    fprintf(stderr, "lzpack: cannot read %s\n", argv[1]);
+    return 1;
+  }
+
+  fclose(f);
+  memset(head, 0xff, HASH_SIZE * sizeof(long));
+
+  outLen = 0;
+  flagPos = 0;
+  item = 8;
+  pos = 0;
+  while (pos < len) {
+
+    long best = 0, bestDist = 0, cand;
+    long max = len - pos < MAX_MATCH ? len - pos : MAX_MATCH;
+
+    if (item == 8) {
+
+      flagPos = outLen++;
+      out[flagPos] = 0;
+      item = 0;
+    }
+
+    if (max >= MIN_MATCH) {
+
+      for (cand = head[hash(in + pos)]; cand >= 0 && pos - cand <= WINDOW; cand = prev[cand]) {
+
+        long n = 0;
+
+        while (n < max && in[cand + n] == in[pos + n])
+          n++;
+
+        if (n > best) {
+
+          best = n;
+          bestDist = pos - cand;
+          if (n == max)
+            break;
+        }
+      }
+    }
+
+    if (best < MIN_MATCH)
+      best = 1;
+
+    if (best == 1) {
+
+      out[flagPos] |= 1 << item;
+      out[outLen++] = in[pos];
+    }
+    else {
+
+      out[outLen++] = (bestDist - 1) & 0xff;
+      out[outLen++] = (((bestDist - 1) >> 8) << 5) | (best - MIN_MATCH);
+    }
+
+    ++item;
+    while (best-- > 0) {
+
+      if (pos + MIN_MATCH <= len) {
+
+        int h = hash(in + pos);
+
+        prev[pos] = head[h];
+        head[h] = pos;
+      }
+
+      ++pos;
+    }
+  }
+
+  memcpy(hdr, "LZS1", 4);
+  put32(hdr + 4, len);
+  put32(hdr + 8, crc32(0, in, len));
+
+  fwrite(hdr, 1, sizeof(hdr), stdout);
+  fwrite(out, 1, outLen, stdout);
+  fprintf(stderr, "lzpack: %s %ld -> %ld bytes\n", argv[1], len, outLen + (long)sizeof(hdr));
+  return 0;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#  1. Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#  3. The name of the author may not be used to endorse or promote
+#     products derived from this software without specific prior written
+#     permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+# OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+# INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#
+# Firmware update server for "ota" command. Serves given
+# image to every client that connects: 12 byte header
+# ("OTA1", length and crc32, little endian) followed by image.
+#
+# usage: otaserve.py emw-meter.bin [port]
+#
+
+import socket
+import struct
+import sys
+import zlib
+
+def main():
+
+    if len(sys.argv) < 2:
+        sys.exit("usage: otaserve.py image [port]")
+
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 4242
+    header = b"OTA1" + struct.pack("<II", len(image), zlib.crc32(image) & 0xffffffff)
+
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(("", port))
+    srv.listen(1)
+    print("serving %s, %d bytes, crc %08x on port %d" %
+          (sys.argv[1], len(image), zlib.crc32(image) & 0xffffffff, port))
+
+    while True:
+        conn, addr = srv.accept()
+        print("update to %s" % addr[0])
+        try:
+            conn.sendall(header + image)
+        except OSError as e:
+            print("failed: %s" % e)
+        conn.close()
+
+if __name__ == "__main__":
+    main()
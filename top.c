@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per-task cpu usage. While "top" measures, a timer
+ * samples current task at 1 kHz. Sleep time comes from
+ * DWT cycle counter, which stops while cpu sleeps:
+ * wall clock time minus counted cycles is time slept.
+ * Stack usage comes from posTaskUnused, task names
+ * from nano layer registry.
+ *
+ * TIM5 does not run in STOP mode, so samples only cover
+ * time cpu was awake or in normal sleep. The 1 kHz interrupt
+ * itself wakes cpu every millisecond, so sleep behaviour
+ * during measurement is not the same as without it.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+#define TOP_RATE       1000
+#define TOP_WINDOW     5
+#define TOP_MAX_WINDOW 30
+#define TOP_TASKS      (POSCFG_MAX_TASKS + 1)
+
+typedef struct {
+
+  POSTASK_t task;
+  uint32_t  samples;
+  uint32_t  switches;
+} TopTask;
+
+static TopTask topTasks[TOP_TASKS];
+static volatile uint32_t topSamples;
+static volatile uint32_t topLost;
+static POSTASK_t lastTask;
+
+/*
+ * Enable DWT cycle counter.
+ */
+void cycleInit()
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void TIM5_irq()
+{
+  POSTASK_t task = posTaskGetCurrent();
+  TopTask* t;
+  int i;
+
+  TIM_ClearITPendingBit(TIM5, TIM_IT_Update);
+
+  for (i = 0, t = topTasks; i < TOP_TASKS; i++, t++) {
+
+    if (t->task == task || t->task == NULL)
+      break;
+  }
+
+  if (i == TOP_TASKS) {
+
+    ++topLost;
+    return;
+  }
+
+  t->task = task;
+  ++t->samples;
+  if (task != lastTask)
+    ++t->switches;
+
+  lastTask = task;
+  ++topSamples;
+}
+
+static void samplerStart()
+{
+  TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+  RCC_ClocksTypeDef clocks;
+  uint32_t clk;
+
+  RCC_GetClocksFreq(&clocks);
+
+/*
+ * APB1 timers run at double PCLK1 when APB1 is prescaled.
+ */
+  clk = clocks.PCLK1_Frequency;
+  if (clk != clocks.HCLK_Frequency)
+    clk *= 2;
+
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+
+  TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+  TIM_TimeBaseStructure.TIM_Prescaler = clk / 1000000 - 1;
+  TIM_TimeBaseStructure.TIM_Period = 1000000 / TOP_RATE - 1;
+  TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+  TIM_TimeBaseInit(TIM5, &TIM_TimeBaseStructure);
+
+  TIM_ClearITPendingBit(TIM5, TIM_IT_Update);
+  TIM_ITConfig(TIM5, TIM_IT_Update, ENABLE);
+
+  NVIC_SetPriority(TIM5_IRQn, PORTCFG_API_MAX_PRI);
+  NVIC_EnableIRQ(TIM5_IRQn);
+  TIM_Cmd(TIM5, ENABLE);
+}
+
+static void samplerStop()
+{
+  TIM_Cmd(TIM5, DISABLE);
+  TIM_ITConfig(TIM5, TIM_IT_Update, DISABLE);
+  NVIC_DisableIRQ(TIM5_IRQn);
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, DISABLE);
+}
+
+static TopTask* findTask(POSTASK_t task)
+{
+  int i;
+
+  for (i = 0; i < TOP_TASKS && topTasks[i].task != NULL; i++)
+    if (topTasks[i].task == task)
+      return &topTasks[i];
+
+  return NULL;
+}
+
+static int percent(uint32_t part, uint32_t total)
+{
+  return total ? (int)((part * 100 + total / 2) / total) : 0;
+}
+
+static int top(EshContext* ctx)
+{
+  char* timeArg = eshNamedArg(ctx, "time", true);
+  NOSREGQHANDLE_t q;
+  NOSGENERICHANDLE_t h;
+  POSTASK_t tasks[TOP_TASKS];
+  char names[TOP_TASKS][NOS_MAX_REGKEYLEN + 1];
+  int unused[TOP_TASKS];
+  int count;
+  int window = TOP_WINDOW;
+  uint32_t cycles;
+  JIF_t start;
+  unsigned long wall, awake;
+  TopTask* t;
+  int i;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+  if (timeArg != NULL) {
+
+    window = atoi(timeArg);
+    if (window < 1 || window > TOP_MAX_WINDOW) {
+
+      eshPrintf(ctx, "Time must be 1-%d seconds.\n", TOP_MAX_WINDOW);
+      return -1;
+    }
+  }
+
+  memset(topTasks, '\0', sizeof(topTasks));
+  topSamples = 0;
+  topLost = 0;
+  lastTask = NULL;
+
+  start = jiffies;
+  cycles = DWT->CYCCNT;
+  samplerStart();
+
+  posTaskSleep(MS(window * 1000));
+
+  samplerStop();
+  cycles = DWT->CYCCNT - cycles;
+  wall = (jiffies - start) * 1000 / HZ;
+  awake = cycles / (SystemCoreClock / 1000);
+  if (awake > wall)
+    awake = wall;
+
+/*
+ * Collect task list and stack figures first, so that registry
+ * is not kept locked while printing. Tasks cannot leave
+ * registry while query is active, so handles stay valid
+ * until stack usage has been taken. Stack scan is done
+ * without scheduler lock, so interrupts are not held off.
+ */
+  count = 0;
+  q = nosRegQueryBegin(REGTYPE_TASK);
+  if (q != NULL) {
+
+    while (count < TOP_TASKS &&
+           nosRegQueryElem(q, &h, names[count], sizeof(names[count])) == E_OK) {
+
+      tasks[count] = (POSTASK_t)h;
+      ++count;
+    }
+
+    for (i = 0; i < count; i++)
+      unused[i] = (int)posTaskUnused(tasks[i]);
+
+    nosRegQueryEnd(q);
+  }
+
+  eshPrintf(ctx, "%lu ms: awake %lu ms (%d%%), sleep %lu ms, %lu samples.\n",
+            wall, awake, percent(awake, wall), wall - awake, (unsigned long)topSamples);
+
+  eshPrintf(ctx, "%-12s %5s %8s %10s\n", "task", "cpu%", "switches", "stack free");
+  for (i = 0; i < count; i++) {
+
+    t = findTask(tasks[i]);
+    eshPrintf(ctx, "%-12s %5d %8lu %10d\n",
+              names[i],
+              t ? percent(t->samples, topSamples) : 0,
+              t ? (unsigned long)t->switches : 0UL,
+              unused[i]);
+
+    if (t != NULL)
+      t->task = (POSTASK_t)-1;
+  }
+
+/*
+ * Tasks that were sampled but are not in registry,
+ * like pico]OS idle task. They might have exited
+ * since, so their stack is not looked at.
+ */
+  for (i = 0, t = topTasks; i < TOP_TASKS && t->task != NULL; i++, t++)
+    if (t->task != (POSTASK_t)-1)
+      eshPrintf(ctx, "%-12s %5d %8lu %10s\n",
+                "(unnamed)",
+                percent(t->samples, topSamples),
+                (unsigned long)t->switches,
+                "-");
+
+  if (topLost)
+    eshPrintf(ctx, "%lu samples lost.\n", (unsigned long)topLost);
+
+  return 0;
+}
+
+const EshCommand topCommand = {
+  .flags = 0,
+  .name = "top",
+  .help = "[--time s]\nshow cpu usage, task switches and free stack of each task.\n"
+          "Sampler stops in STOP mode and its 1 kHz interrupt wakes cpu, so\n"
+          "sleep during measurement differs from normal operation.",
+  .handler = top
+};
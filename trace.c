@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Hot path tracing. Trace points store span begin and
+ * end events with DWT cycle counter timestamp into a ring
+ * buffer in RAM. Slot is reserved with LDREX/STREX, so
+ * trace points can be used from any task without locking.
+ * "trace" shows min/avg/max duration of each span or
+ * raw events. Build with TRACE=1 to enable, otherwise
+ * trace points compile to nothing.
+ */
+
+#include <picoos.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <eshell.h>
+
+#include "emw-meter.h"
+
+#if TRACE
+
+#define TRACE_SIZE 256
+#define TRACE_END_FLAG 0x80
+
+typedef struct {
+
+  uint32_t cycles;
+  uint8_t  id;
+} TraceRecord;
+
+static const char* const traceNames[TRACE_IDS] = {
+  [TRACE_RENDER]  = "render",
+  [TRACE_FLUSH]   = "flush",
+  [TRACE_PARSE]   = "parse",
+  [TRACE_ONEWIRE] = "1-wire"
+};
+
+static TraceRecord traceRing[TRACE_SIZE];
+static volatile uint32_t traceHead;
+static volatile bool traceEnabled = true;
+
+void traceEvent(int id, bool begin)
+{
+  uint32_t i;
+  TraceRecord* r;
+
+  if (!traceEnabled)
+    return;
+
+  do {
+
+    i = __LDREXW(&traceHead);
+  } while (__STREXW(i + 1, &traceHead));
+
+  r = &traceRing[i % TRACE_SIZE];
+  r->cycles = DWT->CYCCNT;
+  r->id = begin ? id : id | TRACE_END_FLAG;
+}
+
+static uint32_t usecs(uint32_t cycles)
+{
+  return cycles / (SystemCoreClock / 1000000);
+}
+
+static void traceRaw(EshContext* ctx, uint32_t first, uint32_t head)
+{
+  TraceRecord* r;
+  uint32_t prev = 0;
+  uint32_t i;
+
+  for (i = first; i != head; i++) {
+
+    r = &traceRing[i % TRACE_SIZE];
+    eshPrintf(ctx, "%10lu %+8ld us %-8s %s\n",
+              (unsigned long)r->cycles,
+              i == first ? 0L : (long)usecs(r->cycles - prev),
+              traceNames[r->id & ~TRACE_END_FLAG],
+              (r->id & TRACE_END_FLAG) ? "end" : "begin");
+
+    prev = r->cycles;
+  }
+}
+
+static void traceStats(EshContext* ctx, uint32_t first, uint32_t head)
+{
+  TraceRecord* r;
+  uint32_t begin[TRACE_IDS];
+  bool open[TRACE_IDS];
+  uint32_t min[TRACE_IDS];
+  uint32_t max[TRACE_IDS];
+  uint32_t sum[TRACE_IDS];
+  uint32_t count[TRACE_IDS];
+  uint32_t d;
+  uint32_t i;
+  int id;
+
+  memset(open, '\0', sizeof(open));
+  memset(max, '\0', sizeof(max));
+  memset(sum, '\0', sizeof(sum));
+  memset(count, '\0', sizeof(count));
+  memset(min, 0xff, sizeof(min));
+
+  for (i = first; i != head; i++) {
+
+    r = &traceRing[i % TRACE_SIZE];
+    id = r->id & ~TRACE_END_FLAG;
+    if (!(r->id & TRACE_END_FLAG)) {
+
+      begin[id] = r->cycles;
+      open[id] = true;
+    }
+    else if (open[id]) {
+
+      d = usecs(r->cycles - begin[id]);
+      if (d < min[id])
+        min[id] = d;
+
+      if (d > max[id])
+        max[id] = d;
+
+      sum[id] += d;
+      ++count[id];
+      open[id] = false;
+    }
+  }
+
+  eshPrintf(ctx, "%-8s %6s %8s %8s %8s\n", "span", "count", "min us", "avg us", "max us");
+  for (id = 0; id < TRACE_IDS; id++)
+    if (count[id])
+      eshPrintf(ctx, "%-8s %6lu %8lu %8lu %8lu\n",
+                traceNames[id],
+                (unsigned long)count[id],
+                (unsigned long)min[id],
+                (unsigned long)(sum[id] / count[id]),
+                (unsigned long)max[id]);
+}
+
+static int trace(EshContext* ctx)
+{
+  bool raw = eshNamedArg(ctx, "raw", false) != NULL;
+  bool clear = eshNamedArg(ctx, "clear", false) != NULL;
+  uint32_t head;
+  uint32_t first;
+
+  eshCheckNamedArgsUsed(ctx);
+  eshCheckArgsUsed(ctx);
+  if (eshArgError(ctx) != EshOK)
+    return -1;
+
+/*
+ * Stop tracing while ring is being read, so that
+ * records are not overwritten under us.
+ */
+  traceEnabled = false;
+  head = traceHead;
+  first = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+
+  if (clear)
+    traceHead = 0;
+  else if (raw)
+    traceRaw(ctx, first, head);
+  else
+    traceStats(ctx, first, head);
+
+  traceEnabled = true;
+  return 0;
+}
+
+const EshCommand traceCommand = {
+  .flags = 0,
+  .name = "trace",
+  .help = "[--raw | --clear]\nshow duration of traced spans, raw trace records or clear trace",
+  .handler = trace
+};
+
+#endif
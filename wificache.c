@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2019, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache of last successful wifi join. Access point
+ * BSSID, channel and security are used to join without
+ * scanning, last DHCP lease is used as address until
+ * DHCP completes.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+
+#include "lwip/netif.h"
+#include "lwip/netifapi.h"
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+
+#include "wwd_wifi.h"
+#include "wiced-driver.h"
+
+#include "emw-meter.h"
+
+#define CACHE_FILE  "/flash/wifi.cache"
+#define CACHE_MAGIC 0x57434831
+
+typedef struct {
+
+  uint32_t magic;
+  char     ssid[33];
+  uint8_t  bssid[6];
+  uint8_t  channel;
+  uint32_t security;
+  uint32_t addr;
+  uint32_t mask;
+  uint32_t gw;
+  uint32_t dns;
+  uint32_t leaseTime;
+} WifiCache;
+
+static WifiCache cache;
+static bool cacheLoaded;
+
+/*
+ * Lease start is only known if it was received
+ * after boot. It is kept in RAM only, as there is
+ * no wall clock to store it against.
+ */
+static bool leaseKnown;
+static JIF_t leaseStart;
+
+static bool cacheLoad()
+{
+  int fd;
+
+  if (cacheLoaded)
+    return cache.magic == CACHE_MAGIC;
+
+  cacheLoaded = true;
+  fd = open(CACHE_FILE, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  if (read(fd, &cache, sizeof(cache)) != sizeof(cache))
+    cache.magic = 0;
+
+  close(fd);
+  return cache.magic == CACHE_MAGIC;
+}
+
+static void cacheSave()
+{
+  int fd;
+
+  fd = open(CACHE_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd == -1)
+    return;
+
+  if (write(fd, &cache, sizeof(cache)) != sizeof(cache))
+    printf("Cannot write " CACHE_FILE ".\n");
+
+  close(fd);
+}
+
+void wifiCacheClear()
+{
+  cacheLoaded = true;
+  leaseKnown = false;
+  memset(&cache, '\0', sizeof(cache));
+  uosFileUnlink(CACHE_FILE);
+}
+
+/*
+ * Join access point using cached details, this skips
+ * scanning for it.
+ */
+bool wifiCacheJoin(const char* ap, const char* pass)
+{
+  wiced_scan_result_t details;
+
+  if (!cacheLoad() || strcmp(cache.ssid, ap))
+    return false;
+
+  memset(&details, '\0', sizeof(details));
+  details.SSID.length = strlen(ap);
+  memcpy(details.SSID.value, ap, details.SSID.length);
+  memcpy(details.BSSID.octet, cache.bssid, sizeof(cache.bssid));
+  details.bss_type = WICED_BSS_TYPE_INFRASTRUCTURE;
+  details.security = (wiced_security_t)cache.security;
+  details.channel = cache.channel;
+  details.band = WICED_802_11_BAND_2_4GHZ;
+
+  return wwd_wifi_join_specific(&details,
+                                (const uint8_t*)pass,
+                                strlen(pass),
+                                NULL,
+                                WWD_STA_INTERFACE) == WWD_SUCCESS;
+}
+
+/*
+ * Use cached lease as static address while DHCP is running.
+ * There is no wall clock, so age of lease from before boot
+ * is not known and it is not used. Lease received after
+ * boot is used if it has not expired.
+ */
+bool wifiCachePreload(struct netif* netif, const char* ap)
+{
+  ip4_addr_t addr;
+  ip4_addr_t mask;
+  ip4_addr_t gw;
+  ip_addr_t dns;
+
+  if (!cacheLoad() || strcmp(cache.ssid, ap) || cache.addr == 0)
+    return false;
+
+  if (!leaseKnown || jiffies - leaseStart >= MS(cache.leaseTime * 1000))
+    return false;
+
+  ip4_addr_set_u32(&addr, cache.addr);
+  ip4_addr_set_u32(&mask, cache.mask);
+  ip4_addr_set_u32(&gw, cache.gw);
+  netifapi_netif_set_addr(netif, &addr, &mask, &gw);
+
+  if (cache.dns) {
+
+    ip_addr_set_ip4_u32(&dns, cache.dns);
+    dns_setserver(0, &dns);
+  }
+
+  return true;
+}
+
+/*
+ * Store details of current join and lease.
+ * File is written only if something has changed.
+ */
+void wifiCacheUpdate(struct netif* netif, const char* ap)
+{
+  wl_bss_info_t apInfo;
+  wiced_security_t security;
+  struct dhcp* dhcp = netif_dhcp_data(netif);
+  const ip_addr_t* dns;
+  WifiCache old;
+
+  if (wwd_wifi_get_ap_info(&apInfo, &security) != WWD_SUCCESS)
+    return;
+
+  cacheLoad();
+  old = cache;
+
+  memset(&cache, '\0', sizeof(cache));
+  cache.magic = CACHE_MAGIC;
+  snprintf(cache.ssid, sizeof(cache.ssid), "%s", ap);
+  memcpy(cache.bssid, &apInfo.BSSID, sizeof(cache.bssid));
+  cache.channel = apInfo.ctl_ch;
+  cache.security = security;
+  cache.addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+  cache.mask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+  cache.gw = ip4_addr_get_u32(netif_ip4_gw(netif));
+
+  dns = dns_getserver(0);
+  if (IP_IS_V4(dns))
+    cache.dns = ip4_addr_get_u32(ip_2_ip4(dns));
+
+  if (dhcp != NULL)
+    cache.leaseTime = dhcp->offered_t0_lease;
+
+  leaseKnown = true;
+  leaseStart = jiffies;
+
+  if (memcmp(&old, &cache, sizeof(cache)))
+    cacheSave();
+}